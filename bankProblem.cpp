@@ -66,25 +66,80 @@ void BankParams3::setPrevIteration(bpl::list const &stateGridList, DoublePyArray
   m_pStateGrid2 = (PyArrayObject const*) m_StateGrid2.data().handle().get();  
   m_PrevIterArray = WArray;	
   m_pPrevIter = (PyArrayObject const*) m_PrevIterArray.data().handle().get();	  
-  m_pPrevIterInterp.reset(new Interp2D(m_StateGrid1, m_StateGrid2, DoublePyMatrix(m_StateGrid1.size(), m_StateGrid2.size(), WArray)));
+  DoublePyMatrix WMatrix(m_StateGrid1.size(), m_StateGrid2.size(), WArray);
+  // only one of the two is built
+  m_pPrevIterInterp.reset();
+  m_pPrevIterSpline.reset();
+  if (m_InterpKind != INTERP_LINEAR) {
+    m_pPrevIterSpline.reset(new Spline2D(m_StateGrid1, m_StateGrid2, WMatrix, m_InterpKind));
+  } else {
+    m_pPrevIterInterp.reset(new Interp2D(m_StateGrid1, m_StateGrid2, WMatrix));
+  }
 }
 
-double BankParams3::objectiveFunction(DoubleVector const &controlVars) const {
+double BankParams3::objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const {
   double d = controlVars[0];
   double slowInFrac = controlVars[1];	
   
-  double EV = calc_EV(d, slowInFrac);
+  double EV = calc_EV(state.m_StateVars[0], state.m_StateVars[1], d, slowInFrac);
   double result = d + m_beta * EV;
   return result;
 }
 
+// same as objectiveFunction() at n (d, slowInFrac) points, with the same arithmetic as calc_EV() for each control, so the results are
+// bit-identical.  the loop over controls is the inner one, and each shock's next states are interpolated in one call per block
+void BankParams3::objectiveFunctionBatch(BellmanStateContext const &state, double const *controls, size_t nArgs, size_t n, double *out) const {
+  assert(nArgs == 2);
+  double M = state.m_StateVars[0];
+  double S = state.m_StateVars[1];
+  assert(M >= 0.0);
+  double nextM[INTERP_BATCH_POINTS], nextS[INTERP_BATCH_POINTS], nextV[INTERP_BATCH_POINTS], sum[INTERP_BATCH_POINTS];
+  for (size_t j0=0; j0<n; j0+=INTERP_BATCH_POINTS) {
+    size_t m = std::min(INTERP_BATCH_POINTS, n - j0);
+	double const *pControls = controls + j0*2;
+	for (size_t j=0; j<m; j++) {
+	  sum[j] = 0.0;
+	}
+    DoublePyArray::const_iterator i1, i2, i3, i5;
+    for (i1=m_FastOutFrac.begin(), i2=m_FastInFrac.begin(), i3=m_SlowOutFrac.begin(), i5=m_ProbSpace.begin();
+         i5 != m_ProbSpace.end(); i1++, i2++, i3++, i5++) {
+      double fast_out_frac = *i1;
+      double fast_in_frac = *i2;
+      double slow_out_frac = *i3;
+      double prob_space = *i5;
+	  double fast_growth = (1.0 + fast_in_frac - fast_out_frac) * (1.0 + m_rFast);
+	  for (size_t j=0; j<m; j++) {
+	    double d = pControls[j*2];
+	    double slow_in_frac = pControls[j*2 + 1];
+        nextM[j] = (M - d + slow_out_frac*S - slow_in_frac*S - fast_out_frac + fast_in_frac)/fast_growth;
+	    nextS[j] = (1.0 + slow_in_frac - slow_out_frac) * S * (1.0 + m_rSlow) / fast_growth;
+	  }
+	  if (m_pPrevIterSpline) {
+	    m_pPrevIterSpline->interp_batch(nextM, nextS, m, nextV);
+	  } else {
+	    m_pPrevIterInterp->interp_batch(nextM, nextS, m, nextV);
+	  }
+	  for (size_t j=0; j<m; j++) {
+	    double V;
+	    if (nextM[j] <= 0.0) {
+	      V = (m_BankruptcyPenalty[0] * nextM[j]) + (m_BankruptcyPenalty[1] * nextS[j]) + m_BankruptcyPenalty[2];
+	    } else {
+	      V = nextV[j];
+	    }
+	    sum[j] += prob_space * fast_growth * V;
+	  }
+    }
+	for (size_t j=0; j<m; j++) {
+	  out[j0 + j] = pControls[j*2] + m_beta * sum[j];
+	}
+  }
+}
+
 // M is actually M/F
 // S is actually S/F
 // M, S, F are all positive, but F is actually a short quantity, so an outflow of S is positive for M, while an outflow
 //   of F is negative
-double BankParams3::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, DoubleVector *pNextS) const {  
-  double M = m_M;
-  double S = m_S;  
+double BankParams3::calc_EV(double M, double S, double d, double slowInFrac, DoubleVector *pNextM, DoubleVector *pNextS) const {  
   assert(M >= 0.0);
   double rFast = m_rFast;
   double rSlow = m_rSlow;
@@ -118,7 +173,7 @@ double BankParams3::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, D
 	  nextS = -1.0;
 	} else {	  
       //V = interp2d_grid(m_pStateGrid1, m_pStateGrid2, m_pPrevIter, nextM, nextS);
-	  V = m_pPrevIterInterp->interp(nextM, nextS);
+	  V = m_pPrevIterSpline ? m_pPrevIterSpline->interp(nextM, nextS) : m_pPrevIterInterp->interp(nextM, nextS);
 	}
 	sum += prob_space * fast_growth * V;	// need to multiply by fast_growth since state variables are divided by F
 	if (pNextM != NULL) {
@@ -133,9 +188,45 @@ double BankParams3::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, D
   return sum;
 }	
 
+// objectiveFunction() as d + the bankruptcy terms + a weighted sum of W at the corners of each shock's interpolation cell
+bool BankParams3::transitionRow(BellmanStateContext const &state, ControlVector const &controlVars, double &rConst, TransitionEntries &rEntries) const {
+  if (m_pPrevIterSpline) throw std::logic_error("transition operators need linear interpolation");
+  if (!m_pPrevIterInterp) throw std::logic_error("setPrevIteration() has not been called");
+  double M = state.m_StateVars[0];
+  double S = state.m_StateVars[1];
+  double d = controlVars[0];
+  double slow_in_frac = controlVars[1];
+  size_t offsets[4];
+  double weights[4];
+  rConst = d;
+  DoublePyArray::const_iterator i1, i2, i3, i5;
+  for (i1=m_FastOutFrac.begin(), i2=m_FastInFrac.begin(), i3=m_SlowOutFrac.begin(), i5=m_ProbSpace.begin();
+       i5 != m_ProbSpace.end(); i1++, i2++, i3++, i5++) {
+    double fast_out_frac = *i1;
+    double fast_in_frac = *i2;
+    double slow_out_frac = *i3;
+    double prob_space = *i5;
+	double fast_growth = (1.0 + fast_in_frac - fast_out_frac) * (1.0 + m_rFast);
+    double nextM = (M - d + slow_out_frac*S - slow_in_frac*S - fast_out_frac + fast_in_frac)/fast_growth;
+	double nextS = (1.0 + slow_in_frac - slow_out_frac) * S * (1.0 + m_rSlow) / fast_growth;
+	double weight = m_beta * prob_space * fast_growth;
+    if (nextM <= 0.0) {
+	  rConst += weight * ((m_BankruptcyPenalty[0] * nextM) + (m_BankruptcyPenalty[1] * nextS) + m_BankruptcyPenalty[2]);
+	} else {
+	  m_pPrevIterInterp->cornerWeights(nextM, nextS, offsets, weights);
+	  for (int k=0; k<4; k++) {
+	    rEntries.push_back(std::make_pair(offsets[k], weight * weights[k]));
+	  }
+	}
+  }
+  return true;
+}
+
 bpl::tuple BankParams3::calc_EV_wrap(double d, double slowInFrac) {
   DoubleVector nextM, nextS;
-  double EV = calc_EV(d, slowInFrac, &nextM, &nextS);
+  // use the state from the last setStateVars() call
+  DoubleVector const &stateVars = getStateVars();
+  double EV = calc_EV(stateVars[0], stateVars[1], d, slowInFrac, &nextM, &nextS);
   return bpl::make_tuple(EV, nextM, nextS);
 }
 
@@ -184,14 +275,29 @@ void BankParams4::setPrevIteration(bpl::list const &stateGridList, DoublePyArray
   m_pStateGrid3 = (PyArrayObject const*) m_StateGrid3.data().handle().get();  
   m_PrevIterArray = WArray;	
   m_pPrevIter = (PyArrayObject const*) m_PrevIterArray.data().handle().get();	  
-  //m_pPrevIterInterp.reset(new Interp2D(m_StateGrid1, m_StateGrid2, DoublePyMatrix(m_StateGrid1.size(), m_StateGrid2.size(), WArray)));
+  DoublePyArrayVector stateGrids(3);
+  stateGrids[0] = m_StateGrid1;
+  stateGrids[1] = m_StateGrid2;
+  stateGrids[2] = m_StateGrid3;
+  m_pPrevIterInterp.reset(new InterpND<3>(stateGrids, WArray));
+  m_pPrevIterSparse.reset();
 }
 
-double BankParams4::objectiveFunction(DoubleVector const &controlVars) const {
+void BankParams4::setPrevIterationSparse(SparseGrid const &grid, DoublePyArray const &WArray) {
+  if (grid.dim() != 3) throw std::invalid_argument("sparse grid must have 3 dimensions");
+  if (WArray.size() != grid.size()) throw std::invalid_argument("W array doesn't match sparse grid size");
+  m_PrevIterArray = WArray;
+  m_pPrevIter = (PyArrayObject const*) m_PrevIterArray.data().handle().get();
+  m_pPrevIterSparse.reset(new SparseGrid(grid));
+  m_pPrevIterSparse->setValues(&WArray[0]);
+  m_pPrevIterInterp.reset();
+}
+
+double BankParams4::objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const {
   double d = controlVars[0];
   double slowInFrac = controlVars[1];	
   
-  double EV = calc_EV(d, slowInFrac);
+  double EV = calc_EV(state.m_StateVars[0], state.m_StateVars[1], state.m_StateVars[2], d, slowInFrac);
   double result = d + m_beta * EV;
   return result;
 }
@@ -200,10 +306,7 @@ double BankParams4::objectiveFunction(DoubleVector const &controlVars) const {
 // S is actually S/F
 // M, S, F are all positive, but F is actually a short quantity, so an outflow of S is positive for M, while an outflow
 //   of F is negative
-double BankParams4::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, DoubleVector *pNextS, DoubleVector *pNextP) const {  
-  double M = m_M;
-  double S = m_S;  
-  double P = m_P;
+double BankParams4::calc_EV(double M, double S, double P, double d, double slowInFrac, DoubleVector *pNextM, DoubleVector *pNextS, DoubleVector *pNextP) const {  
   assert(M >= 0.0);
   double rFast = m_rFast;
   double rSlow = m_rSlow;
@@ -242,8 +345,12 @@ double BankParams4::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, D
 	  V = (m_BankruptcyPenalty[0] * nextM) + (m_BankruptcyPenalty[1] * nextS) + m_BankruptcyPenalty[2];
 	  nextS = -1.0;
 	} else {	  
-      V = interp3d_grid(m_pStateGrid1, m_pStateGrid2, m_pStateGrid3, m_pPrevIter, nextM, nextS, nextP);
-	  //V = m_pPrevIterInterp->interp(nextM, nextS);
+      if (m_pPrevIterSparse) {
+	    double nextState[3] = {nextM, nextS, nextP};
+		V = m_pPrevIterSparse->interp(nextState);
+	  } else {
+        V = (*m_pPrevIterInterp)(nextM, nextS, nextP);
+	  }
 	}
 	sum += prob_space * fast_growth * V;	// need to multiply by fast_growth since state variables are divided by F
 	if (pNextM != NULL) {
@@ -263,9 +370,48 @@ double BankParams4::calc_EV(double d, double slowInFrac, DoubleVector *pNextM, D
   return sum;
 }	
 
+// see BankParams3::transitionRow()
+bool BankParams4::transitionRow(BellmanStateContext const &state, ControlVector const &controlVars, double &rConst, TransitionEntries &rEntries) const {
+  if (m_pPrevIterSparse) throw std::logic_error("transition operators need a tensor state grid");
+  if (!m_pPrevIterInterp) throw std::logic_error("setPrevIteration() has not been called");
+  double M = state.m_StateVars[0];
+  double S = state.m_StateVars[1];
+  double P = state.m_StateVars[2];
+  double d = controlVars[0];
+  double slow_in_frac = controlVars[1];
+  size_t offsets[InterpND<3>::N_CORNERS];
+  double weights[InterpND<3>::N_CORNERS];
+  rConst = d;
+  DoublePyArray::const_iterator i1, i2, i3, i5;
+  for (i1=m_FastOutFrac.begin(), i2=m_FastInFrac.begin(), i3=m_SlowOutFrac.begin(), i5=m_ProbSpace.begin();
+       i5 != m_ProbSpace.end(); i1++, i2++, i3++, i5++) {
+    double fast_out_frac = *i1;
+    double fast_in_frac = *i2;
+    double slow_out_frac = *i3;
+    double prob_space = *i5;
+	double fast_growth = (1.0 + fast_in_frac*P - fast_out_frac) * (1.0 + m_rFast);
+    double nextM = (M - d + slow_out_frac*S - slow_in_frac*S - fast_out_frac + fast_in_frac*P)/fast_growth;
+	double nextS = (1.0 + slow_in_frac - slow_out_frac) * S * (1.0 + m_rSlow) / fast_growth;
+	double nextP = (m_PopGrowth * P) / fast_growth;
+	double weight = m_beta * prob_space * fast_growth;
+    if (nextM <= 0.0) {
+	  rConst += weight * ((m_BankruptcyPenalty[0] * nextM) + (m_BankruptcyPenalty[1] * nextS) + m_BankruptcyPenalty[2]);
+	} else {
+	  double nextState[3] = {nextM, nextS, nextP};
+	  m_pPrevIterInterp->cornerWeights(nextState, offsets, weights);
+	  for (int k=0; k<InterpND<3>::N_CORNERS; k++) {
+	    rEntries.push_back(std::make_pair(offsets[k], weight * weights[k]));
+	  }
+	}
+  }
+  return true;
+}
+
 bpl::tuple BankParams4::calc_EV_wrap(double d, double slowInFrac) {
   DoubleVector nextM, nextS, nextP;
-  double EV = calc_EV(d, slowInFrac, &nextM, &nextS, &nextP);
+  // use the state from the last setStateVars() call
+  DoubleVector const &stateVars = getStateVars();
+  double EV = calc_EV(stateVars[0], stateVars[1], stateVars[2], d, slowInFrac, &nextM, &nextS, &nextP);
   return bpl::make_tuple(EV, nextM, nextS, nextP);
 }
 
@@ -26,28 +26,27 @@ namespace bpl = boost::python;
 // 2 assets: "fast" and "slow"
 class BankParams3: public BellmanParams {
   public:
-	double objectiveFunction(DoubleVector const &args) const;
+	double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const;
+	bool hasStateObjectiveFunction() const { return true; }
+	// the per-shock terms that don't depend on the controls are computed once per batch
+	void objectiveFunctionBatch(BellmanStateContext const &state, double const *controls, size_t nArgs, size_t n, double *out) const;
     BankParams3(double beta, double rFast, double rSlow,
            DoublePyArray const &SlowOutFrac,
 		   DoublePyArray const &FastOutFrac, DoublePyArray const &FastInFrac,
 		   DoublePyArray const &ProbSpace, DoublePyArray const &BankruptcyPenalty);
 	
 	// methods inherited from BellmanParams
-	void setStateVars(bpl::list const &stateVars) {
-	  // M = M/F (per dollar in fast asset)
-	  // S = S/F
-      m_M = bpl::extract<double>(stateVars[0]);
-      m_S = bpl::extract<double>(stateVars[1]);	  
-	}
+	// state vars: M = M/F (per dollar in fast asset), S = S/F
 	int getNControls() const { return 2; }
 	// control grid list is implemented in python
 	void setPrevIteration(bpl::list const &stateGridList, DoublePyArray const &WArray); 
+	// linear interpolation only
+	bool transitionRow(BellmanStateContext const &state, ControlVector const &controlVars, double &rConst, TransitionEntries &rEntries) const;
 
-    double calc_EV(double d, double slowInFrac, DoubleVector *pNextM=NULL, DoubleVector *pNextS=NULL) const;
+    double calc_EV(double M, double S, double d, double slowInFrac, DoubleVector *pNextM=NULL, DoubleVector *pNextS=NULL) const;
 	bpl::tuple calc_EV_wrap(double d, double slowInFrac);
 	
 	double m_beta;				// discount factor	
-	double m_M, m_S;		// state variables
 	double m_rFast, m_rSlow;
 	DoublePyArray m_StateGrid1, m_StateGrid2;
 	PyArrayObject const *m_pStateGrid1, *m_pStateGrid2;
@@ -60,37 +59,34 @@ class BankParams3: public BellmanParams {
 
     DoublePyArray m_PrevIterArray;			// W will be a 2d array	
 	PyArrayObject const *m_pPrevIter;
-	std::shared_ptr<Interp2D> m_pPrevIterInterp;
+	std::shared_ptr<Interp2D> m_pPrevIterInterp;		// null if m_pPrevIterSpline is set
+	std::shared_ptr<Spline2D> m_pPrevIterSpline;	// used instead with m_InterpKind != INTERP_LINEAR
 	//Interp2D *m_pPrevIterInterp;
 };
 
 // with population
 class BankParams4: public BellmanParams {
   public:
-	double objectiveFunction(DoubleVector const &args) const;
+	double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const;
+	bool hasStateObjectiveFunction() const { return true; }
     BankParams4(double beta, double rFast, double rSlow,
            DoublePyArray const &SlowOutFrac,
 		   DoublePyArray const &FastOutFrac, DoublePyArray const &FastInFrac,
 		   DoublePyArray const &ProbSpace, DoublePyArray const &BankruptcyPenalty, double PopGrowth);
 	
 	// methods inherited from BellmanParams
-	void setStateVars(bpl::list const &stateVars) {
-	  // M = M/F (per dollar in fast asset)
-	  // S = S/F
-	  // P = P/F
-      m_M = bpl::extract<double>(stateVars[0]);
-      m_S = bpl::extract<double>(stateVars[1]);
-	  m_P = bpl::extract<double>(stateVars[2]);
-	}
+	// state vars: M = M/F (per dollar in fast asset), S = S/F, P = P/F
 	int getNControls() const { return 2; }
 	// control grid list is implemented in python
 	void setPrevIteration(bpl::list const &stateGridList, DoublePyArray const &WArray); 
+	void setPrevIterationSparse(SparseGrid const &grid, DoublePyArray const &WArray);
+	// tensor grids only
+	bool transitionRow(BellmanStateContext const &state, ControlVector const &controlVars, double &rConst, TransitionEntries &rEntries) const;
 
-    double calc_EV(double d, double slowInFrac, DoubleVector *pNextM=NULL, DoubleVector *pNextS=NULL, DoubleVector *pNextP=NULL) const;
+    double calc_EV(double M, double S, double P, double d, double slowInFrac, DoubleVector *pNextM=NULL, DoubleVector *pNextS=NULL, DoubleVector *pNextP=NULL) const;
 	bpl::tuple calc_EV_wrap(double d, double slowInFrac);
 	
 	double m_beta;				// discount factor	
-	double m_M, m_S, m_P;		// state variables
 	double m_rFast, m_rSlow;
 	double m_PopGrowth;
 	DoublePyArray m_StateGrid1, m_StateGrid2, m_StateGrid3;
@@ -104,8 +100,8 @@ class BankParams4: public BellmanParams {
 
     DoublePyArray m_PrevIterArray;			// W will be a 3d array	
 	PyArrayObject const *m_pPrevIter;
-	//std::shared_ptr<Interp2D> m_pPrevIterInterp;
-	//Interp2D *m_pPrevIterInterp;
+	std::shared_ptr<InterpND<3> > m_pPrevIterInterp;
+	std::shared_ptr<SparseGrid> m_pPrevIterSparse;	// set instead of m_pPrevIterInterp by setPrevIterationSparse()
 };
 
 #endif //_bankProblem_h
\ No newline at end of file
@@ -13,7 +13,7 @@
 
 
 import pylab
-import scipy, time, sys
+import scipy, scipy.linalg, time, sys
 import matplotlib.pyplot as plt
 import pyublas, _debugMsg, _maximizer as mx
 import lininterp2 as linterp
@@ -32,7 +32,21 @@ def maximizer1d(controlGridList, bellmanParams, parallel):
 #   objectiveFunction() is implemented in C++
 #   should implement these member functions: setStateVars, setPrevIteration, getControlGridList, getNControls
 # parallel is a bool, if true, use the parallel grid search algorithm
-def grid_bellman(stateGridList, wArray, bellmanParams, parallel=True):
+# native is a bool, if true, loop over the state grid in C++ (mx.bellmanSweep) instead of python
+# stateGridList can also be an mx.SparseGrid, then wArray and the returned arrays are 1d, one value per grid.points() row,
+#   and the sweep is always native
+# transitions is an mx.TransitionOperator from mx.buildTransitions(stateGridList, wArray, bellmanParams, parallel).  if given, the
+#   objective function is its precomputed sparse matrix times wArray, and bellmanParams isn't called
+def grid_bellman(stateGridList, wArray, bellmanParams, parallel=True, native=False, transitions=None):
+	if (transitions != None):
+		(vVals, optControlVals) = mx.bellmanSweepTransitions(transitions, wArray, parallel)
+		return (vVals, list(optControlVals))
+	if (isinstance(stateGridList, mx.SparseGrid)):
+		(vVals, optControlVals) = mx.bellmanSweepSparse(stateGridList, wArray, bellmanParams, parallel)
+		return (vVals, list(optControlVals))
+	if (native == True):
+		(vVals, optControlVals) = mx.bellmanSweep(stateGridList, wArray, bellmanParams, parallel)
+		return (vVals, list(optControlVals))
 	stateGridLenList = [len(x) for x in stateGridList]
 	nStateVars = len(stateGridList)
 	nControls = bellmanParams.getNControls()
@@ -101,9 +115,13 @@ def iterResultString(code):
 #   - if nMaxIters iterations are reached
 #   - if total time exceeds maxTime
 #   - if the maximum V in the VArray exceeds maxV
+# transitions: passed to grid_bellman.  if True, the transition operator is built once before the first iteration.
+#   the control grids must not depend on the previous iteration
 
 def grid_valueIteration(stateGridList, initialVArray, bellmanParams, stoppingCriterionFn=defaultValueStoppingCriterion, preIterCallbackFn=None, postIterCallbackFn=None, 
-  nMaxIters=None, maxTime=None, maxV=None, parallel=True):
+  nMaxIters=None, maxTime=None, maxV=None, parallel=True, native=False, transitions=None):
+	if (transitions == True):
+		transitions = mx.buildTransitions(stateGridList, initialVArray, bellmanParams, parallel)
 	cont = True	
 	currentVArray = initialVArray
 	stoppingResult = None
@@ -113,7 +131,7 @@ def grid_valueIteration(stateGridList, initialVArray, bellmanParams, stoppingCri
 	
 	while (cont == True):
 		if (preIterCallbackFn != None): preIterCallbackFn()
-		(newVArray, optControls) = grid_bellman(stateGridList, currentVArray, bellmanParams, parallel)
+		(newVArray, optControls) = grid_bellman(stateGridList, currentVArray, bellmanParams, parallel, native, transitions)
 		
 		# decide if we stop iterating
 		if (stoppingCriterionFn != None): 
@@ -132,24 +150,189 @@ def grid_valueIteration(stateGridList, initialVArray, bellmanParams, stoppingCri
 		currentVArray = newVArray
 	return (result, nIter, currentVArray, newVArray, optControls)
 
+# Anderson mixing step.  xHist, gHist are the last iterates x_k and their images g_k = T(x_k), as flat arrays, oldest first.
+# returns the combination of the g's whose residuals g - x have the smallest least-squares combination
+def andersonStep(xHist, gHist):
+	fHist = [g - x for (x, g) in zip(xHist, gHist)]
+	if (len(fHist) < 2):
+		return gHist[-1]
+	dF = scipy.column_stack([fHist[i+1] - fHist[i] for i in range(len(fHist)-1)])
+	dG = scipy.column_stack([gHist[i+1] - gHist[i] for i in range(len(gHist)-1)])
+	gamma = scipy.linalg.lstsq(dF, fHist[-1])[0]
+	return gHist[-1] - scipy.dot(dG, gamma)
+
+# accelerated value iteration, same args and return value as grid_valueIteration.  each sweep is one grid_bellman call, the stopping
+# criterion and callbacks see (current V, Bellman operator applied to it) as usual.  the next iterate is extrapolated from the sweeps:
+# andersonDepth: Anderson mixing over the last andersonDepth iterates (0 = off).  the history is reset if the residual grows
+# beta: if given, the MacQueen-Porteus bounds for a problem with discount factor beta are computed each sweep, and the next iterate
+#   is shifted to the midpoint of the bounds, before Anderson mixing.  only valid if T(V + c) = T(V) + beta*c for constants c
+def grid_acceleratedValueIteration(stateGridList, initialVArray, bellmanParams, stoppingCriterionFn=defaultValueStoppingCriterion, preIterCallbackFn=None, 
+  postIterCallbackFn=None, nMaxIters=None, maxTime=None, maxV=None, parallel=True, native=False, transitions=None, andersonDepth=5, beta=None):
+	if (transitions == True):
+		transitions = mx.buildTransitions(stateGridList, initialVArray, bellmanParams, parallel)
+	cont = True	
+	currentVArray = initialVArray
+	stoppingResult = None
+	nIter = 0
+	beginTime = time.time()
+	result = None
+	xHist = []
+	gHist = []
+	lastResidual = None
+	
+	while (cont == True):
+		if (preIterCallbackFn != None): preIterCallbackFn()
+		(newVArray, optControls) = grid_bellman(stateGridList, currentVArray, bellmanParams, parallel, native, transitions)
+		
+		if (stoppingCriterionFn != None): 
+			stoppingResult = stoppingCriterionFn(nIter, currentVArray, newVArray)
+			if (stoppingResult[0]):
+				cont = False
+				result = ITER_RESULT_CONVERGENCE
+		if (nMaxIters != None and nIter > nMaxIters): cont = False; result = ITER_RESULT_MAX_ITERS
+		if (maxTime != None and time.time() - beginTime > maxTime): cont = False; result = ITER_RESULT_MAX_TIME
+		if (maxV != None and scipy.amax(newVArray) > maxV): cont = False; result = ITER_RESULT_MAX_V
+		
+		if (postIterCallbackFn != None): postIterCallbackFn(nIter, currentVArray, newVArray, optControls, stoppingResult)
+		
+		nIter += 1
+		if (cont == False):
+			currentVArray = newVArray
+			break
+		diff = newVArray - currentVArray
+		# the map being iterated is TV, shifted by the MacQueen-Porteus midpoint if beta is given.  Anderson mixing extrapolates
+		# from the shifted values, so the history stays consistent with what was actually iterated
+		nextVArray = newVArray
+		if (beta != None):
+			lowerBound = beta / (1.0 - beta) * scipy.amin(diff)
+			upperBound = beta / (1.0 - beta) * scipy.amax(diff)
+			nextVArray = newVArray + 0.5 * (lowerBound + upperBound)
+		if (andersonDepth > 0):
+			residual = scipy.amax(abs(diff))
+			if (lastResidual != None and residual > lastResidual):
+				xHist = []
+				gHist = []
+			lastResidual = residual
+			xHist.append(scipy.ravel(currentVArray))
+			gHist.append(scipy.ravel(nextVArray))
+			xHist = xHist[-(andersonDepth+1):]
+			gHist = gHist[-(andersonDepth+1):]
+			nextVArray = scipy.reshape(andersonStep(xHist, gHist), scipy.shape(newVArray))
+		currentVArray = nextVArray
+	return (result, nIter, currentVArray, newVArray, optControls)
+
+# sweep order for grid_gaussSeidelValueIteration: flat state indices, sorted by state variable i, decreasing if reverse=True
+def stateSweepOrder(stateGridList, i=0, reverse=False):
+	stateGridLenList = [len(x) for x in stateGridList]
+	indexGrids = scipy.indices(stateGridLenList)
+	stateVals = scipy.ravel(scipy.asarray(stateGridList[i])[indexGrids[i]])
+	if (reverse == True):
+		stateVals = -stateVals
+	return scipy.argsort(stateVals, kind='mergesort')
+
+# Gauss-Seidel value iteration: each sweep updates V in place, in the given order (see stateSweepOrder; C order if None), so
+# states later in the sweep see the values already updated.  the objective is precomputed with mx.buildTransitions (pass the operator as transitions, or True or None to build it here), so
+# bellmanParams must support transitionRow().  parallel=True is asynchronous value iteration: threads update V at the same time.
+# the other args and the return value are the same as grid_valueIteration.  stoppingCriterionFn sees V before and after each sweep
+def grid_gaussSeidelValueIteration(stateGridList, initialVArray, bellmanParams, order=None, stoppingCriterionFn=defaultValueStoppingCriterion, 
+  preIterCallbackFn=None, postIterCallbackFn=None, nMaxIters=None, maxTime=None, maxV=None, parallel=False, transitions=None):
+	currentVArray = scipy.array(initialVArray, dtype=float, order='C')
+	if (transitions == None or transitions == True):
+		transitions = mx.buildTransitions(stateGridList, currentVArray, bellmanParams, parallel)
+	cont = True	
+	stoppingResult = None
+	nIter = 0
+	beginTime = time.time()
+	result = None
+	
+	while (cont == True):
+		if (preIterCallbackFn != None): preIterCallbackFn()
+		prevVArray = currentVArray.copy()
+		(maxChange, optControls) = mx.bellmanSweepTransitionsInPlace(transitions, currentVArray, order, parallel)
+		optControls = list(optControls)
+		
+		if (stoppingCriterionFn != None): 
+			stoppingResult = stoppingCriterionFn(nIter, prevVArray, currentVArray)
+			if (stoppingResult[0]):
+				cont = False
+				result = ITER_RESULT_CONVERGENCE
+		if (nMaxIters != None and nIter > nMaxIters): cont = False; result = ITER_RESULT_MAX_ITERS
+		if (maxTime != None and time.time() - beginTime > maxTime): cont = False; result = ITER_RESULT_MAX_TIME
+		if (maxV != None and scipy.amax(currentVArray) > maxV): cont = False; result = ITER_RESULT_MAX_V
+		
+		if (postIterCallbackFn != None): postIterCallbackFn(nIter, prevVArray, currentVArray, optControls, stoppingResult)
+		nIter += 1
+	return (result, nIter, prevVArray, currentVArray, optControls)
+
+# modified policy iteration.  every nPolicySweeps-th sweep is a full maximization (native grid_bellman), the ones in between apply
+# the last argmax policy with mx.evaluatePolicy, which doesn't search the control grids.  nPolicySweeps=1 is value iteration.
+# the other args and the return value are the same as grid_valueIteration.  stoppingCriterionFn and postIterCallbackFn are called
+# after each full sweep, and nIter counts full sweeps
+def grid_modifiedPolicyIteration(stateGridList, initialVArray, bellmanParams, nPolicySweeps=10, stoppingCriterionFn=defaultValueStoppingCriterion, 
+  preIterCallbackFn=None, postIterCallbackFn=None, nMaxIters=None, maxTime=None, maxV=None, parallel=True):
+	cont = True	
+	currentVArray = initialVArray
+	stoppingResult = None
+	nIter = 0
+	beginTime = time.time()
+	result = None
+	
+	while (cont == True):
+		if (preIterCallbackFn != None): preIterCallbackFn()
+		(newVArray, optControls) = grid_bellman(stateGridList, currentVArray, bellmanParams, parallel, True)
+		
+		if (stoppingCriterionFn != None): 
+			stoppingResult = stoppingCriterionFn(nIter, currentVArray, newVArray)
+			if (stoppingResult[0]):
+				cont = False
+				result = ITER_RESULT_CONVERGENCE
+		if (nMaxIters != None and nIter > nMaxIters): cont = False; result = ITER_RESULT_MAX_ITERS
+		if (maxTime != None and time.time() - beginTime > maxTime): cont = False; result = ITER_RESULT_MAX_TIME
+		if (maxV != None and scipy.amax(newVArray) > maxV): cont = False; result = ITER_RESULT_MAX_V
+		
+		if (postIterCallbackFn != None): postIterCallbackFn(nIter, currentVArray, newVArray, optControls, stoppingResult)
+		
+		nIter += 1
+		currentVArray = newVArray
+		if (cont == True and nPolicySweeps > 1):
+			currentVArray = mx.evaluatePolicy(stateGridList, newVArray, bellmanParams, optControls, nPolicySweeps - 1, parallel)
+	return (result, nIter, currentVArray, newVArray, optControls)
+
 # same as above, with variable-size grid.
 # intermediateGrids is a list of stateGridLists. interpolate initialVArray to each element, call grid_valueIteration until convergence, 
 # then interpolate to the next elt
-def grid_valueIteration2(intermediateGrids, initialGridList, initialVArray, bellmanParams, nMaxIters=None, maxTime=None, maxV=None, **kwargs):
+# valueIterationFn can be grid_valueIteration or grid_acceleratedValueIteration
+def grid_valueIteration2(intermediateGrids, initialGridList, initialVArray, bellmanParams, nMaxIters=None, maxTime=None, maxV=None, 
+  valueIterationFn=grid_valueIteration, **kwargs):
 	beginTime = time.time()
 	(prevGridList, prevVArray) = (initialGridList, initialVArray)
 	for currentGridList in intermediateGrids:
-		VArray = linterp.interpolateArray(prevGridList, currentGridList, prevVArray);		# interpolate initial guess to new size
+		VArray = mx.interpolateArray(prevGridList, currentGridList, prevVArray);		# interpolate initial guess to new size
 		print("calling grid_valueIteration with gridsize ", [len(g) for g in currentGridList])
-		(result, nIter, currentVArray, newVArray, optControls) = grid_valueIteration(currentGridList, VArray, bellmanParams,
+		(result, nIter, currentVArray, newVArray, optControls) = valueIterationFn(currentGridList, VArray, bellmanParams,
 		  nMaxIters=nMaxIters, maxTime=maxTime, maxV=maxV, **kwargs)
 		if (nMaxIters != None): nMaxIters -= nIter
 		if (maxTime != None): maxTime -= (time.time() - beginTime)
 		(prevGridList, prevVArray) = (currentGridList, currentVArray)
-	finalVArray1 = linterp.interpolateArray(prevGridList, initialGridList, currentVArray);		# interpolate to final size
-	finalVArray2 = linterp.interpolateArray(prevGridList, initialGridList, newVArray)
+	finalVArray1 = mx.interpolateArray(prevGridList, initialGridList, currentVArray);		# interpolate to final size
+	finalVArray2 = mx.interpolateArray(prevGridList, initialGridList, newVArray)
 	return (result, nIter, finalVArray1, finalVArray2, optControls)
 
+# same as grid_valueIteration2 with native sweeps, with the whole schedule in C++ (mx.multigridValueIteration).
+# each level iterates until the largest relative change in V is below tolerance (a number, or a list with one per level).
+# returns the same tuple as grid_valueIteration2, plus a list of per-level stats (dicts: gridSize, nIter, seconds, interpSeconds, maxDiff)
+def grid_multigridValueIteration(intermediateGrids, initialGridList, initialVArray, bellmanParams, tolerance=0.001, nMaxIters=None, maxTime=None, 
+  maxV=None, parallel=True):
+	if (nMaxIters == None): nMaxIters = -1
+	if (maxTime == None): maxTime = -1.0
+	if (maxV == None): maxV = scipy.inf
+	(result, nIter, finalVArray1, finalVArray2, optControls, levelStats) = mx.multigridValueIteration(intermediateGrids, initialGridList, 
+	  scipy.array(initialVArray, dtype=float), bellmanParams, tolerance, nMaxIters, maxTime, maxV, parallel)
+	for stats in levelStats:
+		print("gridsize %s: %d iterations, %f sec (%f sec interpolating), maxdiff %g" % (stats['gridSize'], stats['nIter'], stats['seconds'], 
+		  stats['interpSeconds'], stats['maxDiff']))
+	return (result, nIter, finalVArray1, finalVArray2, list(optControls), levelStats)
+
 ## functions for policy iteration
 
 # L T_sigma operator in p.144 of Stachurski	
@@ -172,7 +355,16 @@ def LT_sigma(policyFnList, stateGridList, wArray, bellmanParams):
 
 # given a policy (state -> control mapping) and a guess for V, return the value (state -> utility), i.e. utility if we followed the policy
 # policyArrayList is a list of arrays on stateGrids
-def getValueOfPolicy(policyArrayList, stateGridList, initialVArray, bellmanParams):
+# native: solve for the value directly in C++ (mx.solvePolicyValue), needs bellmanParams.transitionRow()
+def getValueOfPolicy(policyArrayList, stateGridList, initialVArray, bellmanParams, native=False, parallel=True):
+	if (native == True):
+		tol = 1e-10
+		(vVals, nIter, residual) = mx.solvePolicyValue(stateGridList, initialVArray, bellmanParams, policyArrayList, tol, 1000, parallel)
+		print("getValueOfPolicy %d iterations residual %g" % (nIter, residual))
+		if (residual < tol):
+			return vVals
+		# the linear solve broke down or didn't converge, use the fixed-point iteration below
+		print("getValueOfPolicy: linear solve failed, falling back to iteration")
 	bContinue = True
 	policyFnList = [linterp.GetLinterpFnObj(stateGridList, policyArray) for policyArray in policyArrayList]
 	currentVArray = initialVArray
@@ -189,8 +381,8 @@ def getValueOfPolicy(policyArrayList, stateGridList, initialVArray, bellmanParam
 	return currentVArray
 
 # calculate a policy that maximizes the given V
-def getGreedyPolicy(stateGridList, wArray, bellmanParams, parallel=False):
-	(vVals, optControlVals) = grid_bellman(stateGridList, wArray, bellmanParams, parallel);
+def getGreedyPolicy(stateGridList, wArray, bellmanParams, parallel=False, native=False):
+	(vVals, optControlVals) = grid_bellman(stateGridList, wArray, bellmanParams, parallel, native);
 	return optControlVals	
 
 def defaultPolicyStoppingCriterion(nIter, currentPolicyArrayList, greedyPolicyList, criterion=0.0001):
@@ -201,7 +393,7 @@ def defaultPolicyStoppingCriterion(nIter, currentPolicyArrayList, greedyPolicyLi
 	return ((maxdiff < criterion), maxdiff)
 	
 def grid_policyIteration(stateGridList, initialPolicyArrayList, initialVArray, bellmanParams, stoppingCriterionFn=defaultPolicyStoppingCriterion, 
-  preIterCallbackFn=None, postIterCallbackFn=None, nMaxIters=None, parallel=False):
+  preIterCallbackFn=None, postIterCallbackFn=None, nMaxIters=None, parallel=False, native=False):
 	cont = True	
 	currentPolicyArrayList = initialPolicyArrayList	
 	currentVArray = initialVArray
@@ -209,8 +401,8 @@ def grid_policyIteration(stateGridList, initialPolicyArrayList, initialVArray, b
 	nIter = 0
 	while (cont == True and (nMaxIters == None or nIter <= nMaxIters)):
 		if (preIterCallbackFn != None): preIterCallbackFn()
-		newVArray = getValueOfPolicy(currentPolicyArrayList, stateGridList, currentVArray, bellmanParams)
-		greedyPolicyList = getGreedyPolicy(stateGridList, newVArray, bellmanParams, parallel)		
+		newVArray = getValueOfPolicy(currentPolicyArrayList, stateGridList, currentVArray, bellmanParams, native, parallel)
+		greedyPolicyList = getGreedyPolicy(stateGridList, newVArray, bellmanParams, parallel, native)		
 		if (stoppingCriterionFn != None): 
 			stoppingResult = stoppingCriterionFn(nIter, currentPolicyArrayList, greedyPolicyList)
 			if (stoppingResult[0]):
@@ -286,6 +478,28 @@ def test1():
 	print(fnArray)
 	print("max: %f" % scipy.amax(fnArray))
 	print result
+
+# mx.SparseGrid reproduces multilinear functions exactly at every level, and the error on a smooth function shrinks as the level goes up
+def test_sparseGrid(nTestPoints=200):
+	lo = scipy.array([0.0, -1.0, 1.0])
+	hi = scipy.array([2.0, 1.0, 4.0])
+	def multilinearFn(x):
+		return 1.0 + 2.0*x[0] - x[1] + 0.5*x[2] + 3.0*x[0]*x[1] - x[1]*x[2] + 0.25*x[0]*x[1]*x[2]
+	def smoothFn(x):
+		return scipy.exp(0.3*x[0]) * scipy.cos(x[1]) + scipy.log(x[2])
+	testPoints = lo + (hi - lo) * scipy.random.random_sample((nTestPoints, len(lo)))
+	def maxError(grid, fn):
+		grid.setValues(scipy.array([fn(x) for x in grid.points()]))
+		return max([abs(grid(x) - fn(x)) for x in testPoints])
+	prevErr = None
+	for level in range(7):
+		grid = mx.SparseGrid(lo, hi, level)
+		multilinearErr = maxError(grid, multilinearFn)
+		smoothErr = maxError(grid, smoothFn)
+		print("level %d, %d points: multilinear error %g, smooth error %g" % (level, grid.size(), multilinearErr, smoothErr))
+		assert(multilinearErr < 1e-10)
+		if (prevErr != None): assert(smoothErr < prevErr)
+		prevErr = smoothErr
 	
 # keep track of iterations	
 g_iterList = [{}]
@@ -23,7 +23,8 @@
 #include <boost/bind.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <random>
-#include <boost/timer.hpp>
+#include <chrono>
+#include "tbb/combinable.h"
 
 #include "consumptionSavings.h"
 #include "maximizer.h"
@@ -37,14 +38,20 @@ using namespace python;
 using namespace pyublas;
 using namespace std;
 
-static double g_TotalElapsedTime;
-static int g_nEVCalls;
+// calcEV timing (wall clock).  calcEV runs on several threads, so each one keeps its own totals, summed when they're printed
+struct EVTiming {
+  double m_TotalElapsedTime;
+  int m_nEVCalls;
+  EVTiming() : m_TotalElapsedTime(0.0), m_nEVCalls(0) {}
+};
+static tbb::combinable<EVTiming> g_EVTiming;
 
 ConsumptionSavingsParams::ConsumptionSavingsParams(DoublePyArray const &stateGrid, double gamma, double beta, double mean1, double mean2, double var2,
   EVMethodT evMethod)
 : m_StateGrid(stateGrid), m_gamma(gamma), m_beta(beta), m_mean1(mean1), m_mean2(mean2), m_var2(var2)
 {
   m_pStateGrid = (PyArrayObject const*) m_StateGrid.data().handle().get();
+  m_pStateGridLookup.reset(new Grid1D(m_StateGrid));
   assert(gamma >= 1.0);
   if (gamma == 1.0) {	// log utility
 	m_uFn = LogUtil();
@@ -63,8 +70,7 @@ ConsumptionSavingsParams::ConsumptionSavingsParams(DoublePyArray const &stateGri
     [&] () -> double { return exp(normal(rng)); });
   std::sort(m_RandomDrawsSorted.begin(), m_RandomDrawsSorted.end());
   // timing EV
-  g_TotalElapsedTime = 0.0;
-  g_nEVCalls = 0;  
+  g_EVTiming.clear();
 }
 
 // given lognormal shock Z (distributed with mean2, var2), calculate next period's wealth.
@@ -81,11 +87,22 @@ double nextW_to_Z(double s1, double s2, double W, double expMean1, double nextW)
 void ConsumptionSavingsParams::setPrevIteration(DoublePyArray const &WArray) {
   m_PrevIteration = WArray;	
   m_pPrevIterationArray = (PyArrayObject const*) m_PrevIteration.data().handle().get();
-  m_pPrevIterationInterp.reset(new PyInterp1D(m_StateGrid, m_PrevIteration));
+  m_pPrevIterationInterp.reset(new InterpView(m_pStateGridLookup, m_StateGrid, m_PrevIteration));
+  m_pPrevIterationSpline.reset();
+  if (m_InterpKind != INTERP_LINEAR) {
+    // the other EV methods integrate the linear interpolation directly
+    if (m_EVMethod != EV_MONTECARLO) throw std::logic_error("spline interpolation requires EV_MONTECARLO");
+    m_pPrevIterationSpline.reset(new Spline1D(m_StateGrid, m_PrevIteration, m_InterpKind));
+  }
 
-  printf("%d calls, avg time per EV call: %f\n", g_nEVCalls, g_TotalElapsedTime/g_nEVCalls);
-  g_TotalElapsedTime = 0.0;
-  g_nEVCalls = 0;
+  EVTiming total = g_EVTiming.combine([] (EVTiming const &a, EVTiming const &b) -> EVTiming {
+    EVTiming sum;
+	sum.m_TotalElapsedTime = a.m_TotalElapsedTime + b.m_TotalElapsedTime;
+	sum.m_nEVCalls = a.m_nEVCalls + b.m_nEVCalls;
+	return sum;
+  });
+  printf("%d calls, avg time per EV call: %f\n", total.m_nEVCalls, total.m_TotalElapsedTime/total.m_nEVCalls);
+  g_EVTiming.clear();
   if (m_EVMethod == EV_CUDA_MONTECARLO) {
     const double *pFGridBegin = &m_StateGrid[0];
     const double *pFGridEnd = &m_StateGrid[0] + m_StateGrid.size();
@@ -99,13 +116,30 @@ void ConsumptionSavingsParams::setPrevIteration(DoublePyArray const &WArray) {
 
 double ConsumptionSavingsParams::calcEV(double s1, double s2, double W, double expMean1) const {
   double result = -DBL_MAX;
-  boost::timer t1;
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
   switch (m_EVMethod) {
     case EV_MONTECARLO:
-      result = calculateEV_montecarlo_1d(
-        [=](double Z) -> double { return (*(this->m_pPrevIterationInterp))(Z_to_nextW(s1, s2, W, expMean1, Z)); }, 
-	    m_RandomDrawsSorted
-	  );
+	  {
+	    // map a block of draws to next period's wealth, then interpolate the block in one call
+	    double nextW[INTERP_BATCH_POINTS], nextV[INTERP_BATCH_POINTS];
+	    size_t nDraws = m_RandomDrawsSorted.size();
+	    double sum = 0.0;
+	    for (size_t i0=0; i0<nDraws; i0+=INTERP_BATCH_POINTS) {
+	      size_t m = std::min(INTERP_BATCH_POINTS, nDraws - i0);
+	      for (size_t i=0; i<m; i++) {
+	        nextW[i] = Z_to_nextW(s1, s2, W, expMean1, m_RandomDrawsSorted[i0 + i]);
+	      }
+	      if (m_pPrevIterationSpline) {
+	        m_pPrevIterationSpline->interp_batch(nextW, m, nextV);
+	      } else {
+	        m_pPrevIterationInterp->interp_batch(nextW, m, nextV);
+	      }
+	      for (size_t i=0; i<m; i++) {
+	        sum += nextV[i];
+	      }
+	    }
+	    result = sum / nDraws;
+	  }
 	  break;
 	case EV_MONTECARLO2: {
 	    // pre-apply Z_to_nextW to random draws.  must be monotonic
@@ -140,15 +174,15 @@ double ConsumptionSavingsParams::calcEV(double s1, double s2, double W, double e
 	  assert(false);
 	  result = -DBL_MAX;
   }
-  double elapsed = t1.elapsed();
-  g_TotalElapsedTime += elapsed;
-  g_nEVCalls++;
+  EVTiming &timing = g_EVTiming.local();
+  timing.m_TotalElapsedTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+  timing.m_nEVCalls++;
   
   return result;
 }
     	  
-double ConsumptionSavingsParams::objectiveFunction(DoubleVector const &controlVars) const {
-  double W = m_wealth;				// wealth
+double ConsumptionSavingsParams::objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const {
+  double W = state.m_StateVars[0];	// wealth
   double c = controlVars[0];		
   double cf = c/W;
   double s1 = controlVars[1];		// fraction of wealth invested in asset 1
@@ -161,13 +195,13 @@ double ConsumptionSavingsParams::objectiveFunction(DoubleVector const &controlVa
 }
 
 double ConsumptionSavingsParams::u (double cf, double s1) const {
-  double W = m_wealth;				// wealth
+  double W = getWealth();			// wealth
   return m_uFn(cf*W);
 }
 
 double ConsumptionSavingsParams::EV (double cf, double s1) const {
   double s2 = 1.0 - cf - s1;		// fraction of wealth invested in asset 2
-  double W = m_wealth;				// wealth
+  double W = getWealth();			// wealth
   double expMean1 = exp(m_mean1);
   return calcEV(s1, s2, W, expMean1);    
 }
@@ -177,7 +211,7 @@ BOOST_PYTHON_MODULE(_consumptionSavings)
 {                              
   bpl::class_<ConsumptionSavingsParams, bpl::bases<BellmanParams>>("ConsumptionSavingsParams", bpl::init<DoublePyArray, 
     double, double, double, double, double, EVMethodT>())
-		.def_readonly("wealth", &ConsumptionSavingsParams::m_wealth)
+		.add_property("wealth", &ConsumptionSavingsParams::getWealth)
 		.def("u", &ConsumptionSavingsParams::u)
 		.def("EV", &ConsumptionSavingsParams::EV)
     ;  
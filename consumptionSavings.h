@@ -28,17 +28,18 @@ enum EVMethodT {EV_MONTECARLO, EV_MONTECARLO2, EV_CUDA_MONTECARLO, EV_PARTIAL_EX
 // consumption-savings problem with CRRA utility, two lognormal assets
 class ConsumptionSavingsParams: public BellmanParams {
   public:
-    double objectiveFunction(DoubleVector const &args) const;
+    double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const;
 	
     ConsumptionSavingsParams(DoublePyArray const &stateGrid, double gamma, double beta, double mean1, double mean2, double var2, EVMethodT evMethod);
 	double u (double cf, double s) const;
 	double EV (double cf, double s) const;
 	double calcEV (double s1, double s2, double W, double expMean1) const;
 	
+	double getWealth() const { return getStateVars()[0]; }
+	
 	// methods inherited from BellmanParams
-	void setStateVars(bpl::list const &stateVars) {
-	  m_wealth = bpl::extract<double>(stateVars[0]);
-	}
+	// state var: wealth
+	bool hasStateObjectiveFunction() const { return true; }
 	int getNControls() const {
 	  return 2;
 	}
@@ -46,10 +47,11 @@ class ConsumptionSavingsParams: public BellmanParams {
 		
     DoublePyArray m_StateGrid;				// grid over wealth
 	PyArrayObject const *m_pStateGrid;	
-	double m_wealth;						// state variable: wealth
+	std::shared_ptr<Grid1D const> m_pStateGridLookup;
     DoublePyArray m_PrevIteration;			// store the previous iteration of the value function
 	PyArrayObject const *m_pPrevIterationArray;	
-	std::shared_ptr<PyInterp1D> m_pPrevIterationInterp;
+	std::shared_ptr<InterpView> m_pPrevIterationInterp;	// borrows m_StateGrid and m_PrevIteration
+	std::shared_ptr<Spline1D> m_pPrevIterationSpline;	// used instead with m_InterpKind != INTERP_LINEAR
 	ddFnObj m_uFn;							// utility function for consumption
 	double m_gamma;							// CRRA utility parameter (1 for log utility)	
 	double m_beta;				// discrete discount factor
@@ -19,15 +19,23 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <chrono>
+#include <algorithm>
 
 #include <boost/python.hpp>
 #include <boost/foreach.hpp>
+#include <boost/math/tools/minima.hpp>
 #include <numpy/arrayobject.h>
 #include "tbb/parallel_reduce.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
+#include "tbb/task_arena.h"
 #include "tbb/blocked_range2d.h"
 
 #include "myTypes.h"
 #include "maximizer.h"
+#include "sparseMatrix.h"
+#include "simd.h"
 
 #define foreach         BOOST_FOREACH
 #define reverse_foreach BOOST_REVERSE_FOREACH
@@ -36,6 +44,30 @@ namespace bpl = boost::python;
 // Intel TBB multi-threaded library
 using namespace tbb;
 
+// all parallel grid searches run in this arena, so that nested state and control loops share one set of threads
+static task_arena g_MaximizerArena;
+
+// minimum number of objective function calls in one TBB task.  smaller tasks don't amortize the scheduling overhead
+const size_t MIN_TASK_EVALS = 32;
+
+// automatic grain size for a range where each item costs about nEvalsPerItem objective function calls.
+// a 20x20 control grid is split into ~12 tasks; a state range is only split down to 1 state if its control grid is big enough.
+inline size_t autoGrainSize(size_t nEvalsPerItem) {
+  if (nEvalsPerItem == 0) {
+    return MIN_TASK_EVALS;
+  }
+  return std::max<size_t>(1, (MIN_TASK_EVALS + nEvalsPerItem - 1) / nEvalsPerItem);
+}
+
+// set the number of threads used by the maximizer. 0 means use the TBB default (# of cores)
+void setMaxThreads(int nThreads) {
+  g_MaximizerArena.terminate();
+  g_MaximizerArena.initialize((nThreads > 0) ? nThreads : int(task_arena::automatic));
+}
+int getMaxThreads() {
+  return g_MaximizerArena.max_concurrency();
+}
+
 
 // 2d grid search.  returns # of values found
 int gridSearch2D(DoublePyArray const &controlGrid1, DoublePyArray const &controlGrid2, MaximizerCallParams &params,  double &rMaxVal, double &rArgmax1, double &rArgmax2) {
@@ -52,9 +84,9 @@ int gridSearch2D(DoublePyArray const &controlGrid1, DoublePyArray const &control
   int i=0, count=0;
   // evaluate params.objectiveFunction at every point in the control grid
   DoublePyArray::const_iterator iter1, iter2;
+  ControlVector args(2);
   for (iter1 = controlGrid1.begin(); iter1 != controlGrid1.end(); iter1++) {
     for (iter2 = controlGrid2.begin(); iter2 != controlGrid2.end(); iter2++) {
-	  DoubleVector args(2);
       args[0] = *iter1;
 	  args[1] = *iter2;
       //result = (*pFn)(arg1, arg2, pArgs);
@@ -94,7 +126,7 @@ public:
   
   void operator()( const blocked_range2d<size_t, size_t>& r ) {   
     double value;
-    DoubleVector args(2);		
+    ControlVector args(2);		
     // r is a 2-dimensonal range
     for( size_t i=r.rows().begin(); i!=r.rows().end(); ++i ){
 	  //pData1 = (m_pGrid1->data) + (m_stride1 * i);
@@ -143,14 +175,15 @@ public:
 
 // TBB will divide up the task range among threads with a blocked_range.
 // for N arbitrary dimensions, we need to use a 1d blocked_range, and then translate the index given in each range into the correct N-dimensional coordinates.
-// wrap a gridArray with something that maps indices to a 1d range (obviously total size can't exceed the max value of an int)
-inline unsigned int IndexListTo1D(IntVector const &lenArray, IntVector const &indexArray) {
-  unsigned int i;  
+// wrap a gridArray with something that maps indices to a 1d range.  the 1d index is a size_t, so on 64-bit builds
+// the total grid size can be more than 2^32
+inline size_t IndexListTo1D(IntVector const &lenArray, IntVector const &indexArray) {
+  size_t i;  
   assert(lenArray.size() == indexArray.size());
   if (lenArray.size() == 0) {
     return 0;
   }
-  unsigned int result = indexArray[0];
+  size_t result = indexArray[0];
   for (i=1; i<lenArray.size(); i++) {
     result *= lenArray[i];
     result += indexArray[i];
@@ -158,7 +191,7 @@ inline unsigned int IndexListTo1D(IntVector const &lenArray, IntVector const &in
   return result;
 }
 
-inline void Index1DToArray(unsigned int index, IntVector const &lenArray, IntVector &dest) {
+inline void Index1DToArray(size_t index, IntVector const &lenArray, IntVector &dest) {
   int i;
   //dest.resize(lenArray.size());
   for (i=lenArray.size()-1; i>=0; i--) {
@@ -170,308 +203,669 @@ inline void Index1DToArray(unsigned int index, IntVector const &lenArray, IntVec
 }
 
 
-// multidimensional version
-class MaxIndexFnObj2 {  
-public:
-  double m_value_of_max;
-  DoubleVector m_argmax;
-  MaximizerCallParams &m_params;
-  DoublePyArrayVector const &m_ControlGridArray;
-  IntVector m_lenArray;  
-  
-  void operator_any( const blocked_range<size_t>& r ) {   
-    char *pData = NULL;    
-	double value, arg;
-	unsigned int j;
-	IntVector indexArray(m_lenArray.size());
-	DoubleVector argArray(m_lenArray.size());
-    
-    for( size_t index=r.begin(); index!=r.end(); ++index ){
-	  Index1DToArray(index, m_lenArray, indexArray);
-	  for (j=0; j<indexArray.size(); j++) {
-	    //pData = (m_gridPtrArray[j]->data) + (m_gridPtrArray[j]->strides[0] * indexArray[j]);
-		pData = ((char*) (m_ControlGridArray[j].array().data())) + (m_ControlGridArray[j].strides()[0] * indexArray[j]);
-		arg = * (double*) pData;
-		argArray[j] = arg;
-	  }
-      value = m_params.objectiveFunction(argArray);	  
-      if (value > m_value_of_max) {
-        m_value_of_max = value;
-		m_argmax = argArray;
-      }
-    }
+int gridSearch2DParallel(DoublePyArray const &controlGrid1, DoublePyArray const &controlGrid2, MaximizerCallParams &params, double &rMaxVal, double &rArgmax1, double &rArgmax2) {
+  assert(controlGrid1.ndim() == controlGrid2.ndim() &&  controlGrid1.ndim() == 1); 
+  
+  MaxIndexFnObj fnObj(controlGrid1, controlGrid2, params);
+  int len1 = controlGrid1.dims()[0];
+  int len2 = controlGrid2.dims()[0];  
+  //printf("calling parallel_reduce\n");
+  parallel_reduce( blocked_range2d<size_t>(0, len1, 16, 0, len2, 16), fnObj);  
+  //printf("returned from parallel_reduce\n");
+  rMaxVal = fnObj.m_value_of_max;
+  rArgmax1 = fnObj.m_argmax1;
+  rArgmax2 = fnObj.m_argmax2;
+  return 1;
+}
+
+// argmax-with-tie-count kernels.  every exhaustive grid search evaluates the objective function into a buffer, then
+// reduces the buffer with one of these: the max of vals[0..n), the index of its first occurrence, and the number of times it occurs.
+// all versions return the same result: max is found in a first pass as (v > max) ? v : max, starting from vals[0],
+// so a NaN is skipped unless it's vals[0]; then matches are counted in a second pass.
+typedef int (*ArgmaxKernelFn)(double const *vals, size_t n, double &rMax, size_t &rArgmax);
+
+inline int bitCount(unsigned int m) {
+  int count = 0;
+  for (; m != 0; m &= m - 1) {
+    count++;
+  }
+  return count;
+}
+inline int lowestBitIndex(unsigned int m) {
+  int i = 0;
+  for (; (m & 1) == 0; m >>= 1) {
+    i++;
   }
+  return i;
+}
 
-  void operator()( const blocked_range<size_t>& r ) {
-    int nArgs = m_lenArray.size();
-	switch (nArgs) {
-	  case 1:
-	    operator_1(r);
-		break;
-	  case 2:
-	    operator_2(r);
-		break;
-	  case 3:
-	    operator_3(r);
-		break;
-	  default:
-	    operator_any(r);
-		break;
-	}
+// the NaN case: vals[0] is NaN, so the max is NaN, which never compares equal.  same as the scalar search, the first point wins
+inline int argmaxResult(double max, size_t firstIndex, int count, double &rMax, size_t &rArgmax) {
+  rMax = max;
+  if (count == 0) {
+    rArgmax = 0;
+	return 1;
   }
+  rArgmax = firstIndex;
+  return count;
+}
 
-  void operator_1( const blocked_range<size_t>& r ) {   
-	double value;
-	IntVector indexArray(m_lenArray.size());
-	DoubleVector argArray(m_lenArray.size());
-    Index1DToArray(r.begin(), m_lenArray, indexArray);
-	
-	int nStride0 = m_ControlGridArray[0].strides()[0];
-	const char *pBegin0 = (const char*) (m_ControlGridArray[0].array().data());
-	const char *pEnd0 = pBegin0 + (nStride0 * m_ControlGridArray[0].size());
-	const char *pData0 = pBegin0 + (nStride0 * indexArray[0]);
-	
-    for( size_t index=r.begin(); index!=r.end(); ++index ){
-      argArray[0] = * (double*) pData0;
+int argmaxWithCount_scalar(double const *vals, size_t n, double &rMax, size_t &rArgmax) {
+  if (n == 0) {
+    return 0;
+  }
+  double max = vals[0];
+  for (size_t i=1; i<n; i++) {
+    max = (vals[i] > max) ? vals[i] : max;
+  }
+  int count = 0;
+  size_t firstIndex = n;
+  for (size_t i=0; i<n; i++) {
+    if (vals[i] == max) {
+	  if (count == 0) {
+	    firstIndex = i;
+	  }
+	  count++;
+	}
+  }
+  return argmaxResult(max, firstIndex, count, rMax, rArgmax);
+}
 
-  	  value = m_params.objectiveFunction(argArray);	  
-      if (value > m_value_of_max) {
-        m_value_of_max = value;
-		m_argmax = argArray;
-      }
-	  
-	  pData0 += nStride0;	  
-    }
+#ifdef SIMD_X86
+TARGET_AVX2 int argmaxWithCount_avx2(double const *vals, size_t n, double &rMax, size_t &rArgmax) {
+  if (n == 0) {
+    return 0;
   }
-  void operator_2( const blocked_range<size_t>& r ) {   
-	double value;
-	IntVector indexArray(m_lenArray.size());
-	DoubleVector argArray(m_lenArray.size());	
-    Index1DToArray(r.begin(), m_lenArray, indexArray);
-
-	int nStride0 = m_ControlGridArray[0].strides()[0];
-	const char *pBegin0 = (const char*) (m_ControlGridArray[0].array().data());
-	const char *pEnd0 = pBegin0 + (nStride0 * m_lenArray[0]);
-	const char *pData0 = pBegin0 + (nStride0 * indexArray[0]);
-	int nStride1 = m_ControlGridArray[1].strides()[0];
-	const char *pBegin1 = (const char*) (m_ControlGridArray[1].array().data());
-	const char *pEnd1 = pBegin1 + (nStride1 * m_lenArray[1]);
-	const char *pData1 = pBegin1 + (nStride1 * indexArray[1]);
-	
-    for( size_t index=r.begin(); index!=r.end(); ++index ){
-      argArray[0] = * (double*) pData0;
-	  argArray[1] = * (double*) pData1;
-
-  	  value = m_params.objectiveFunction(argArray);	  
-      if (value > m_value_of_max) {
-        m_value_of_max = value;
-		m_argmax = argArray;
-      }
+  size_t i;
+  // _mm256_max_pd(v, max) is (v > max) ? v : max in each lane
+  __m256d vMax = _mm256_set1_pd(vals[0]);
+  for (i=0; i+4<=n; i+=4) {
+    vMax = _mm256_max_pd(_mm256_loadu_pd(vals + i), vMax);
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, vMax);
+  double max = vals[0];
+  for (int j=0; j<4; j++) {
+    max = (lanes[j] > max) ? lanes[j] : max;
+  }
+  for (; i<n; i++) {
+    max = (vals[i] > max) ? vals[i] : max;
+  }
+  
+  int count = 0;
+  size_t firstIndex = n;
+  vMax = _mm256_set1_pd(max);
+  for (i=0; i+4<=n; i+=4) {
+    unsigned int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(vals + i), vMax, _CMP_EQ_OQ));
+	if (mask != 0) {
+	  if (count == 0) {
+	    firstIndex = i + lowestBitIndex(mask);
+	  }
+	  count += bitCount(mask);
+	}
+  }
+  for (; i<n; i++) {
+    if (vals[i] == max) {
+	  if (count == 0) {
+	    firstIndex = i;
+	  }
+	  count++;
+	}
+  }
+  return argmaxResult(max, firstIndex, count, rMax, rArgmax);
+}
 
-	  pData1 += nStride1;
-	  if (pData1 == pEnd1) {
-	    pData1 = pBegin1;
-	    pData0 += nStride0;
-	  }	  
-    }
+TARGET_AVX512 int argmaxWithCount_avx512(double const *vals, size_t n, double &rMax, size_t &rArgmax) {
+  if (n == 0) {
+    return 0;
   }
-  void operator_3( const blocked_range<size_t>& r ) {   
-	double value;
-	IntVector indexArray(m_lenArray.size());
-	DoubleVector argArray(m_lenArray.size());
-    Index1DToArray(r.begin(), m_lenArray, indexArray);
-
-	int nStride0 = m_ControlGridArray[0].strides()[0];
-	const char *pBegin0 = (const char*) (m_ControlGridArray[0].array().data());
-	const char *pEnd0 = pBegin0 + (nStride0 * m_ControlGridArray[0].size());
-	const char *pData0 = pBegin0 + (nStride0 * indexArray[0]);
-	int nStride1 = m_ControlGridArray[1].strides()[0];
-	const char *pBegin1 = (const char*) (m_ControlGridArray[1].array().data());
-	const char *pEnd1 = pBegin1 + (nStride1 * m_ControlGridArray[1].size());
-	const char *pData1 = pBegin1 + (nStride1 * indexArray[1]);
-	int nStride2 = m_ControlGridArray[2].strides()[0];
-	const char *pBegin2 = (const char*) (m_ControlGridArray[2].array().data());
-	const char *pEnd2 = pBegin2 + (nStride2 * m_ControlGridArray[2].size());
-	const char *pData2 = pBegin2 + (nStride2 * indexArray[2]);
-	
-    for( size_t index=r.begin(); index!=r.end(); ++index ){
-      argArray[0] = * (double*) pData0;
-	  argArray[1] = * (double*) pData1;
-	  argArray[2] = * (double*) pData2;
-
-  	  value = m_params.objectiveFunction(argArray);	  
-      if (value > m_value_of_max) {
-        m_value_of_max = value;
-		m_argmax = argArray;
-      }
+  size_t i;
+  __m512d vMax = _mm512_set1_pd(vals[0]);
+  for (i=0; i+8<=n; i+=8) {
+    vMax = _mm512_max_pd(_mm512_loadu_pd(vals + i), vMax);
+  }
+  double lanes[8];
+  _mm512_storeu_pd(lanes, vMax);
+  double max = vals[0];
+  for (int j=0; j<8; j++) {
+    max = (lanes[j] > max) ? lanes[j] : max;
+  }
+  for (; i<n; i++) {
+    max = (vals[i] > max) ? vals[i] : max;
+  }
+  
+  int count = 0;
+  size_t firstIndex = n;
+  vMax = _mm512_set1_pd(max);
+  for (i=0; i+8<=n; i+=8) {
+    unsigned int mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(vals + i), vMax, _CMP_EQ_OQ);
+	if (mask != 0) {
+	  if (count == 0) {
+	    firstIndex = i + lowestBitIndex(mask);
+	  }
+	  count += bitCount(mask);
+	}
+  }
+  for (; i<n; i++) {
+    if (vals[i] == max) {
+	  if (count == 0) {
+	    firstIndex = i;
+	  }
+	  count++;
+	}
+  }
+  return argmaxResult(max, firstIndex, count, rMax, rArgmax);
+}
+#endif //SIMD_X86
 
-	  pData2 += nStride2;
-	  if (pData2 == pEnd2) {
-	    pData2 = pBegin2;
-	    pData1 += nStride1;
-		if (pData1 == pEnd1) {
-		  pData1 = pBegin1;
-		  pData0 += nStride0;
-		}
-	  }	  
-    }
+// pick the widest kernel this CPU supports.  done once, at load time
+ArgmaxKernelFn selectArgmaxKernel() {
+#ifdef SIMD_X86
+  if (cpuHasAVX512F()) {
+    return argmaxWithCount_avx512;
+  }
+  if (cpuHasAVX2()) {
+    return argmaxWithCount_avx2;
   }
+#endif //SIMD_X86
+  return argmaxWithCount_scalar;
+}
 
-  void operator_cp( const blocked_range<size_t>& r ) {   
-    char *pData = NULL;    
-	double value;
+static const ArgmaxKernelFn g_ArgmaxKernel = selectArgmaxKernel();
 
-    CartesianProductIterator iter(m_ControlGridArray, r.begin());    
-	CartesianProductIterator end(m_ControlGridArray, r.end());    
-    for( size_t index=r.begin(); index!=r.end(); ++index, iter++ ){
-	  value = m_params.objectiveFunction(*iter);
-      if (value > m_value_of_max) {
-        m_value_of_max = value;
-		m_argmax = *iter;
-      }
-    }
+inline int argmaxWithCount(double const *vals, size_t n, double &rMax, size_t &rArgmax) {
+  return g_ArgmaxKernel(vals, n, rMax, rArgmax);
+}
+
+// maximum number of control grid points evaluated in one objectiveFunctionBatch() call
+const size_t BATCH_POINTS = 256;
+
+// TBB body for my_maximizer2.  the range is over flat indices into the control grid (C order, last grid varies fastest).
+// each block of BATCH_POINTS points is unpacked into a contiguous buffer, evaluated with one objectiveFunctionBatch() call,
+// and reduced to max, argmax and multiplicity.
+// N is the number of controls, so the unpacking loops are unrolled by the compiler.  N = 0 means the number of controls is only known at runtime
+template <int N>
+class GridSearch {
+public:
+  MaximizerCallParams const &m_params;
+  int m_nGrids;
+  char const *m_pBegin[MAX_CONTROLS];	// grid data, stride and length of each control grid
+  npy_intp m_Stride[MAX_CONTROLS];
+  size_t m_Len[MAX_CONTROLS];
+  double m_MaxVal;
+  size_t m_ArgMaxIndex;			// flat index of the first argmax
+  size_t m_nMultiplicity;
+  
+  int nGrids() const {
+    return (N > 0) ? N : m_nGrids;
   }
   
-  MaxIndexFnObj2( MaxIndexFnObj2& x, split ) :  // split constructor from tbb    
-    m_value_of_max(-DBL_MAX), // -DBL_MAX from <climits>
-    m_argmax(x.m_argmax),
-	m_params(x.m_params), m_ControlGridArray(x.m_ControlGridArray), m_lenArray(x.m_lenArray)	
-  {
+  // write the points with flat indices [blockStart, blockStart+n) into controls. one div/mod per control for the first point,
+  // then the data pointers are stepped like nested loops over the grids
+  void unpackBlock(size_t blockStart, size_t n, double *controls) const {
+    const int nG = nGrids();
+	size_t indexArray[MAX_CONTROLS];
+	char const *pArg[MAX_CONTROLS];
+	size_t index = blockStart;
+	for (int i=nG-1; i>=0; i--) {
+	  indexArray[i] = index % m_Len[i];
+	  index /= m_Len[i];
+	  pArg[i] = m_pBegin[i] + m_Stride[i] * indexArray[i];
+	}
+	for (size_t k=0; k<n; k++) {
+	  for (int i=0; i<nG; i++) {
+	    controls[k*nG + i] = * (double const*) pArg[i];
+	  }
+	  for (int i=nG-1; i>=0; i--) {
+	    pArg[i] += m_Stride[i];
+		if (++indexArray[i] < m_Len[i]) {
+		  break;
+		}
+		indexArray[i] = 0;
+		pArg[i] = m_pBegin[i];
+	  }
+	}
   }
-  // this is where results from different threads will be compared
-  void join( const MaxIndexFnObj2& y ) {
-    if (y.m_value_of_max > m_value_of_max) {
-      m_value_of_max = y.m_value_of_max;
-	  m_argmax = y.m_argmax;	  
-    }
-  }  
-  MaxIndexFnObj2(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params) :    
-    m_value_of_max(-DBL_MAX), // -DBL_MAX from <climits>
-    m_argmax(controlGridArray.size(), -DBL_MAX), m_lenArray(controlGridArray.size()),
-	m_params(params), m_ControlGridArray(controlGridArray)
-  {
-    for (unsigned int i=0; i<controlGridArray.size(); i++) {
-	  m_lenArray[i] = controlGridArray[i].dims()[0];
+
+  void operator()( const blocked_range<size_t>& r ) {
+	// buffers on the stack: the search does no allocation unless the objective function does
+	double controls[BATCH_POINTS * MAX_CONTROLS], fArray[BATCH_POINTS];
+	for (size_t blockStart=r.begin(); blockStart<r.end(); blockStart += BATCH_POINTS) {
+	  size_t n = std::min(BATCH_POINTS, r.end() - blockStart);
+	  unpackBlock(blockStart, n, controls);
+	  m_params.objectiveFunctionBatch(controls, nGrids(), n, fArray);
+	  double blockMax;
+	  size_t blockArgmax;
+	  int count = argmaxWithCount(fArray, n, blockMax, blockArgmax);
+	  merge(blockMax, blockStart + blockArgmax, count);
+	}
+  }
+  // combine with the result of a later part of the range
+  void merge(double maxval, size_t argmaxIndex, size_t count) {
+    if (count == 0) {
+	  return;
+	}
+    if (m_nMultiplicity == 0 || maxval > m_MaxVal) {
+	  m_MaxVal = maxval;
+	  m_ArgMaxIndex = argmaxIndex;
+	  m_nMultiplicity = count;
+	} else if (maxval == m_MaxVal) {
+	  m_ArgMaxIndex = std::min(m_ArgMaxIndex, argmaxIndex);
+	  m_nMultiplicity += count;
+	}
+  }
+  GridSearch( GridSearch& x, split ) :
+    m_params(x.m_params), m_nGrids(x.m_nGrids), m_MaxVal(-DBL_MAX), m_ArgMaxIndex(0), m_nMultiplicity(0) {
+	std::copy(x.m_pBegin, x.m_pBegin + m_nGrids, m_pBegin);
+	std::copy(x.m_Stride, x.m_Stride + m_nGrids, m_Stride);
+	std::copy(x.m_Len, x.m_Len + m_nGrids, m_Len);
+  }
+  void join( const GridSearch& y ) {
+    merge(y.m_MaxVal, y.m_ArgMaxIndex, y.m_nMultiplicity);
+  }
+  GridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams const &params) :
+    m_params(params), m_nGrids(controlGridArray.size()), m_MaxVal(-DBL_MAX), m_ArgMaxIndex(0), m_nMultiplicity(0) {
+	assert(N == 0 || N == m_nGrids);
+	if (m_nGrids > int(MAX_CONTROLS)) {
+	  throw std::length_error("grid search: too many control variables");
+	}
+	for (int i=0; i<m_nGrids; i++) {
+	  m_pBegin[i] = (char const*) controlGridArray[i].array().data();
+	  m_Stride[i] = controlGridArray[i].strides()[0];
+	  m_Len[i] = controlGridArray[i].size();
 	}
   }
+  
+  // search the flat index range [firstIndex, totalGridSize)
+  void run(size_t firstIndex, size_t totalGridSize, bool bParallel) {
+    if (bParallel) {
+      g_MaximizerArena.execute([&] {
+        // split down to MIN_TASK_EVALS points so small control grids still spread over the threads; a range shorter than
+        // BATCH_POINTS is evaluated as one short batch
+        parallel_reduce( blocked_range<size_t>(firstIndex, totalGridSize, autoGrainSize(1)), *this, auto_partitioner());
+	  });
+    } else {
+      (*this)(blocked_range<size_t>(firstIndex, totalGridSize));
+    }
+  }
 };
 
-int gridSearch2DParallel(DoublePyArray const &controlGrid1, DoublePyArray const &controlGrid2, MaximizerCallParams &params, double &rMaxVal, double &rArgmax1, double &rArgmax2) {
-  assert(controlGrid1.ndim() == controlGrid2.ndim() &&  controlGrid1.ndim() == 1); 
-  
-  MaxIndexFnObj fnObj(controlGrid1, controlGrid2, params);
-  int len1 = controlGrid1.dims()[0];
-  int len2 = controlGrid2.dims()[0];  
-  //printf("calling parallel_reduce\n");
-  parallel_reduce( blocked_range2d<size_t>(0, len1, 16, 0, len2, 16), fnObj);  
-  //printf("returned from parallel_reduce\n");
-  rMaxVal = fnObj.m_value_of_max;
-  rArgmax1 = fnObj.m_argmax1;
-  rArgmax2 = fnObj.m_argmax2;
-  return 1;
+template <int N>
+void runGridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams const &params, size_t firstIndex, size_t totalGridSize, bool bParallel,
+  double &rMaxVal, size_t &rArgMaxIndex, size_t &rCount) {
+  GridSearch<N> search(controlGridArray, params);
+  search.run(firstIndex, totalGridSize, bParallel);
+  rMaxVal = search.m_MaxVal;
+  rArgMaxIndex = search.m_ArgMaxIndex;
+  rCount = search.m_nMultiplicity;
 }
 
-// parallel version with arbitrary dimensions
-int gridSearchParallel(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray) {  
+// exhaustive grid search using params.objectiveFunctionBatch().
+// firstIndex0, endIndex0: only search the points of control grid 0 with index in [firstIndex0, endIndex0)
+void my_maximizer2(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmaxArray, double &rMaxval, bool bParallel,
+  size_t firstIndex0, size_t endIndex0) {
   int nGrids = controlGridArray.size();
-  int i;
-  IntVector lenArray(nGrids);
-  
-  for (i=0; i<nGrids; i++) {
-    // check that all grids are 1-dimensional
-    assert(controlGridArray[i].ndim() == 1);  
-	lenArray[i] = controlGridArray[i].dims()[0];
-  }
-
-  unsigned int totalGridSize = 1;
+  size_t totalGridSize = 1;
   double totalGridSize2 = 1.0;
-  for (i=0; i<nGrids; i++) {
-	totalGridSize *= lenArray[i];
-	totalGridSize2 *= double(lenArray[i]);
+  for (int i=0; i<nGrids; i++) {
+	totalGridSize *= controlGridArray[i].size();
+	totalGridSize2 *= double(controlGridArray[i].size());
   }
+  rCount = 0;
+  rMaxval = -DBL_MAX;
   // check that total grid space isn't too large to be indexed
-  assert(totalGridSize2 < double(UINT_MAX));
+  if (totalGridSize2 >= double(std::numeric_limits<size_t>::max())) {
+    throw std::overflow_error("grid search: control grid has too many points to index");
+  }
+  if (nGrids == 0 || totalGridSize == 0) {
+    return;
+  }
+  size_t len0 = controlGridArray[0].size();
+  size_t firstIndex = std::min(firstIndex0, len0) * (totalGridSize / len0);
+  size_t endIndex = std::max(firstIndex, std::min(endIndex0, len0) * (totalGridSize / len0));
   
-  MaxIndexFnObj2 fnObj(controlGridArray, params);  
-  parallel_reduce( blocked_range<size_t>(0, totalGridSize), fnObj);  
+  // calculate the objective function over every grid point, in blocks.  pick the unrolled version for the number of controls once, here
+  double maxval = -DBL_MAX;
+  size_t argmaxIndex = 0;
+  size_t count = 0;
+  switch (nGrids) {
+    case 1: runGridSearch<1>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+    case 2: runGridSearch<2>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+    case 3: runGridSearch<3>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+    case 4: runGridSearch<4>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+    case 5: runGridSearch<5>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+    case 6: runGridSearch<6>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+	default: runGridSearch<0>(controlGridArray, params, firstIndex, endIndex, bParallel, maxval, argmaxIndex, count); break;
+  }
+  if (count == 0) {
+    return;
+  }
+  // multiplicity is returned as an int, which a tie over more than 2^31 points would overflow
+  rCount = int(std::min<size_t>(count, INT_MAX));
+  rMaxval = maxval;
+  rArgmaxArray.resize(nGrids);
+  size_t index = argmaxIndex;
+  for (int i=nGrids-1; i>=0; i--) {
+    rArgmaxArray[i] = controlGridArray[i][index % controlGridArray[i].size()];
+	index /= controlGridArray[i].size();
+  }
+}
 
-  rMaxVal = fnObj.m_value_of_max;
-  rArgMaxArray.resize(fnObj.m_argmax.size());
-  copy(fnObj.m_argmax.begin(), fnObj.m_argmax.end(), rArgMaxArray.begin());
-  return 1;
+// parallel version with arbitrary dimensions
+// firstIndex0, endIndex0: only search the points of control grid 0 with index in [firstIndex0, endIndex0)
+int gridSearchParallel(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0,
+  size_t endIndex0) {  
+  int count;
+  my_maximizer2(controlGridArray, params, count, rArgMaxArray, rMaxVal, true, firstIndex0, endIndex0);
+  return count;
 }
   
 // single-threaded grid search with an arbitrary number of dimensions
-int gridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray) {  
-  int nGrids = controlGridArray.size();
-  int i;
-  IntVector lenArray(nGrids), strideArray(nGrids), dataIndexArray(nGrids);
+// firstIndex0, endIndex0: only search the points of control grid 0 with index in [firstIndex0, endIndex0)
+int gridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0,
+  size_t endIndex0) {  
+  int count;
+  my_maximizer2(controlGridArray, params, count, rArgMaxArray, rMaxVal, false, firstIndex0, endIndex0);
+  return count;
+}
+
+// search for the max of a concave objective function by nested bisection.
+// the max over the last control is found by bisection; with the earlier controls fixed, that max is itself a concave function 
+// of the control before it, so it can be bisected in turn, and so on up to control 0.
+// this takes O(log M_0 * ... * log M_n) objective function calls instead of M_0 * ... * M_n.
+class ConcaveSearch {
+public:
+  DoublePyArrayVector const &m_ControlGridArray;
+  MaximizerCallParams &m_params;
+  int m_nGrids;
+  IntVector m_lenArray;
+  size_t m_firstIndex0, m_endIndex0;			// limits of control 0
+  ControlVector m_ArgArray;						// current point
+  IntVector m_IndexArray;						// grid indices of the current point
+  DoubleVector m_BestVal;						// best value found so far at each level of the recursion
+  IntVector m_nEvaluated;						// points evaluated so far at each level
+  std::vector<DoubleVector> m_BestArgArray;		// for level d, the point where m_BestVal[d] was found
+  std::vector<IntVector> m_BestIndexArray;
+  bool m_bUndetermined;							// a bisection step compared two infeasible (-DBL_MAX or NaN) values
+  
+  ConcaveSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, size_t firstIndex0, size_t endIndex0) 
+  : m_ControlGridArray(controlGridArray), m_params(params), m_nGrids(controlGridArray.size()), m_lenArray(controlGridArray.size()), 
+    m_firstIndex0(firstIndex0), m_endIndex0(endIndex0), m_ArgArray(controlGridArray.size()), m_IndexArray(controlGridArray.size()), m_BestVal(controlGridArray.size()),
+	m_nEvaluated(controlGridArray.size()), m_BestArgArray(controlGridArray.size(), DoubleVector(controlGridArray.size())),
+	m_BestIndexArray(controlGridArray.size(), IntVector(controlGridArray.size())), m_bUndetermined(false)
+  {
+    for (int i=0; i<m_nGrids; i++) {
+	  m_lenArray[i] = controlGridArray[i].dims()[0];
+	}
+  }
+  
+  double gridValue(int d, int i) const {
+    const char *pData = (const char*) (m_ControlGridArray[d].array().data());
+	return * (double*) (pData + m_ControlGridArray[d].strides()[0] * i);
+  }
   
-  for (i=0; i<nGrids; i++) {
+  // value at index i of control d, maximized over controls d+1..n-1.  controls 0..d-1 are fixed in m_ArgArray
+  double valueAt(int d, int i) {
+    m_ArgArray[d] = gridValue(d, i);
+	m_IndexArray[d] = i;
+	double value;
+	if (d == m_nGrids-1) {
+	  value = m_params.objectiveFunction(m_ArgArray);
+	} else {
+	  value = maxOverDim(d+1);
+	}
+	// the first point is always recorded, so the argmax is a grid point even if nothing beats -DBL_MAX
+	if (m_nEvaluated[d]++ == 0 || value > m_BestVal[d]) {
+	  m_BestVal[d] = value;
+	  std::copy(m_ArgArray.begin() + d, m_ArgArray.end(), m_BestArgArray[d].begin() + d);
+	  std::copy(m_IndexArray.begin() + d, m_IndexArray.end(), m_BestIndexArray[d].begin() + d);
+	}
+	return value;
+  }
+  
+  // max over controls d..n-1, with controls 0..d-1 fixed.  on return, m_ArgArray[d..n-1] holds the argmax
+  double maxOverDim(int d) {
+    int lo = (d == 0) ? int(m_firstIndex0) : 0;
+	int hi = (d == 0) ? int(std::min<size_t>(m_endIndex0, m_lenArray[d])) - 1 : m_lenArray[d] - 1;
+	m_BestVal[d] = -DBL_MAX;
+	m_nEvaluated[d] = 0;
+	// if f(mid) < f(mid+1), the max of a concave f is to the right of mid, otherwise it's at or to the left of mid.
+	// an infeasible point (-DBL_MAX or NaN) is below any feasible one; if both are infeasible, the direction is unknown
+	// and the search gives up, see m_bUndetermined
+	while (hi - lo > 2) {
+	  int mid = (lo + hi) / 2;
+	  double f1 = valueAt(d, mid);
+	  double f2 = valueAt(d, mid+1);
+	  if (m_bUndetermined) {
+	    return -DBL_MAX;
+	  }
+	  bool bFeasible1 = (f1 > -DBL_MAX), bFeasible2 = (f2 > -DBL_MAX);
+	  if (!bFeasible1 && !bFeasible2) {
+	    m_bUndetermined = true;
+		return -DBL_MAX;
+	  }
+	  if (!bFeasible1 || (bFeasible2 && f1 < f2)) {
+	    lo = mid + 1;
+	  } else {
+	    hi = mid;
+	  }
+	}
+	for (int i=lo; i<=hi; i++) {
+	  valueAt(d, i);
+	  if (m_bUndetermined) {
+	    return -DBL_MAX;
+	  }
+	}
+	std::copy(m_BestArgArray[d].begin() + d, m_BestArgArray[d].end(), m_ArgArray.begin() + d);
+	std::copy(m_BestIndexArray[d].begin() + d, m_BestIndexArray[d].end(), m_IndexArray.begin() + d);
+	return m_BestVal[d];
+  }
+  
+  // check that the argmax is a local max along each control.  this fails if the objective isn't concave
+  bool validate(double maxval) {
+    IntVector bestIndexArray(m_IndexArray);
+	ControlVector bestArgArray(m_ArgArray);
+	bool bValid = true;
+	for (int d=0; d<m_nGrids && bValid; d++) {
+	  for (int step=-1; step<=1; step+=2) {
+	    int i = bestIndexArray[d] + step;
+		if (i < (d == 0 ? int(m_firstIndex0) : 0) || i >= m_lenArray[d] || (d == 0 && size_t(i) >= m_endIndex0)) {
+		  continue;
+		}
+		m_ArgArray[d] = gridValue(d, i);
+		if (m_params.objectiveFunction(m_ArgArray) > maxval) {
+		  bValid = false;
+		  break;
+		}
+	  }
+	  m_ArgArray[d] = bestArgArray[d];
+	}
+	return bValid;
+  }
+};
+
+// grid search for a concave objective function.  returns 1, or the result of gridSearch() if validation fails, the bisection
+// meets two infeasible points, or nothing above -DBL_MAX is found (so those cases give the same result as the exhaustive search)
+// firstIndex0: skip the points of control grid 0 below this index
+// bValidate: check the neighbors of the argmax, fall back to an exhaustive search if one of them is higher
+// bParallel: the fallback search is gridSearchParallel()
+// endIndex0: only search the points of control grid 0 below this index
+int gridSearchConcave(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0, bool bValidate,
+  bool bParallel, size_t endIndex0) {
+  int nGrids = controlGridArray.size();
+  for (int i=0; i<nGrids; i++) {
     // check that all grids are 1-dimensional
     assert(controlGridArray[i].ndim() == 1);  
-	lenArray[i] = controlGridArray[i].dims()[0];
-	strideArray[i] = controlGridArray[i].strides()[0];
-	dataIndexArray[i] = 0;
+	// if one grid has zero size then there's nothing to do
+	if (controlGridArray[i].dims()[0] <= (i == 0 ? npy_intp(firstIndex0) : 0) || (i == 0 && endIndex0 <= firstIndex0)) {
+	  return 0;
+	}
+  }
+  if (nGrids == 0) {
+    return 0;
   }
+  ConcaveSearch search(controlGridArray, params, firstIndex0, endIndex0);
+  double maxval = search.maxOverDim(0);
+  if (search.m_bUndetermined || !(maxval > -DBL_MAX) || (bValidate && !search.validate(maxval))) {
+    if (bParallel) {
+	  return gridSearchParallel(controlGridArray, params, rMaxVal, rArgMaxArray, firstIndex0, endIndex0);
+	}
+    return gridSearch(controlGridArray, params, rMaxVal, rArgMaxArray, firstIndex0, endIndex0);
+  }
+  rMaxVal = maxval;
+  rArgMaxArray.resize(nGrids);
+  std::copy(search.m_ArgArray.begin(), search.m_ArgArray.end(), rArgMaxArray.begin());
+  return 1;
+}
 
-  DoubleVector argArray(nGrids);  
-  int nIter = 0;
-  int nMaxMultiplicity = 0;  
-  bool bDone = false;
-  
-  // check for zero size, if one grid has zero size then there's nothing to do
-  for (i=0; i<nGrids; i++) {
-    if (lenArray[i] == 0) {
-	  bDone = true;
-	  break;
+// index of x in an ascending grid (the first grid point >= x)
+inline int gridIndexOf(DoublePyArray const &grid, double x) {
+  int i = std::lower_bound(grid.begin(), grid.end(), x) - grid.begin();
+  return std::min<int>(i, grid.size() - 1);
+}
+
+// bounded Nelder-Mead maximization of params.objectiveFunction over the box [lo, hi].
+// controls with lo == hi are held fixed.  points that step outside the box are projected back onto it.
+// rX is the starting point on entry, and the argmax on exit.  returns the max
+double nelderMeadMax(MaximizerCallParams &params, DoubleVector const &lo, DoubleVector const &hi, ControlVector &rX, double fx, int nMaxIters, double tol) {
+  const double alpha = 1.0, gamma = 2.0, rho = 0.5, sigma = 0.5;
+  IntVector freeDims;
+  for (unsigned int i=0; i<rX.size(); i++) {
+    if (hi[i] > lo[i]) {
+	  freeDims.push_back(i);
 	}
   }
-  double max = -DBL_MAX;
-  while (!bDone) {
-    double result;
-	// get double array args from char* data
-	for (i=0; i<nGrids; i++) {
-	  char *pData = (char*) (controlGridArray[i].array().data());
-	  char *pArg = pData + (strideArray[i] * dataIndexArray[i]);
-	  argArray[i] = *(double*) pArg;
-	}
-	result = params.objectiveFunction(argArray);
-	if (nIter == 0) {			// first iteration
-      max = result;
-	  rArgMaxArray.resize(argArray.size());
-	  copy(argArray.begin(), argArray.end(), rArgMaxArray.begin());		
-	  nMaxMultiplicity = 1;
-    } else {
-      if (result > max) {
-        max = result;
-		rArgMaxArray.resize(argArray.size());
-		copy(argArray.begin(), argArray.end(), rArgMaxArray.begin());		
-	    nMaxMultiplicity = 1;
-	  } else if (result == max) {
-	    nMaxMultiplicity++;
-	  }
-	}
-	nIter++;
-
-    // increment indices for next iteration
-	bDone = true;
-	for (i=nGrids-1; i>=0; i--) {
-	  // increment index i
-	  dataIndexArray[i] += 1;
-	  if (dataIndexArray[i] == lenArray[i]) {
-	    // cycle this index
-		dataIndexArray[i] = 0;
+  int n = freeDims.size();
+  if (n == 0) {
+    return fx;
+  }
+  auto project = [&] (ControlVector &x) {
+    for (unsigned int i=0; i<x.size(); i++) {
+	  x[i] = std::max(lo[i], std::min(hi[i], x[i]));
+	}
+  };
+  // initial simplex: rX, plus a step of half the box along each free control
+  std::vector<ControlVector> simplex(n+1, rX);
+  DoubleVector fSimplex(n+1);
+  fSimplex[0] = fx;
+  for (int j=0; j<n; j++) {
+    int d = freeDims[j];
+	double step = 0.5 * (hi[d] - lo[d]);
+	simplex[j+1][d] += (rX[d] + step <= hi[d]) ? step : -step;
+	project(simplex[j+1]);
+	fSimplex[j+1] = params.objectiveFunction(simplex[j+1]);
+  }
+  IntVector order(n+1);
+  ControlVector centroid(rX.size()), xr(rX.size()), xe(rX.size()), xc(rX.size());
+  for (int iter=0; iter<nMaxIters; iter++) {
+    // sort vertices, best first
+    for (int j=0; j<=n; j++) {
+	  order[j] = j;
+	}
+	std::sort(order.begin(), order.end(), [&] (int a, int b) { return fSimplex[a] > fSimplex[b]; });
+	int best = order[0], worst = order[n], secondWorst = order[n-1];
+	if (fabs(fSimplex[best] - fSimplex[worst]) <= tol * (fabs(fSimplex[best]) + tol)) {
+	  break;
+	}
+	// centroid of all vertices except the worst
+	std::fill(centroid.begin(), centroid.end(), 0.0);
+	for (int j=0; j<n; j++) {
+	  for (unsigned int i=0; i<centroid.size(); i++) {
+	    centroid[i] += simplex[order[j]][i] / double(n);
+	  }
+	}
+	// reflect
+	for (unsigned int i=0; i<xr.size(); i++) {
+	  xr[i] = centroid[i] + alpha * (centroid[i] - simplex[worst][i]);
+	}
+	project(xr);
+	double fr = params.objectiveFunction(xr);
+	if (fr > fSimplex[best]) {
+	  // expand
+	  for (unsigned int i=0; i<xe.size(); i++) {
+	    xe[i] = centroid[i] + gamma * (xr[i] - centroid[i]);
+	  }
+	  project(xe);
+	  double fe = params.objectiveFunction(xe);
+	  if (fe > fr) {
+	    simplex[worst] = xe;
+		fSimplex[worst] = fe;
 	  } else {
-	    bDone = false;
-		break;
+	    simplex[worst] = xr;
+		fSimplex[worst] = fr;
+	  }
+	} else if (fr > fSimplex[secondWorst]) {
+	  simplex[worst] = xr;
+	  fSimplex[worst] = fr;
+	} else {
+	  // contract towards the worst vertex
+	  for (unsigned int i=0; i<xc.size(); i++) {
+	    xc[i] = centroid[i] + rho * (simplex[worst][i] - centroid[i]);
+	  }
+	  double fc = params.objectiveFunction(xc);
+	  if (fc > fSimplex[worst]) {
+	    simplex[worst] = xc;
+		fSimplex[worst] = fc;
+	  } else {
+	    // shrink towards the best vertex
+		for (int j=1; j<=n; j++) {
+		  int k = order[j];
+		  for (unsigned int i=0; i<rX.size(); i++) {
+		    simplex[k][i] = simplex[best][i] + sigma * (simplex[k][i] - simplex[best][i]);
+		  }
+		  fSimplex[k] = params.objectiveFunction(simplex[k]);
+		}
 	  }
-	  // if we make it here, all indices have cycled, therefore we are done
 	}
-	
   }
-  rMaxVal = max;
-  return nMaxMultiplicity;
+  int best = std::max_element(fSimplex.begin(), fSimplex.end()) - fSimplex.begin();
+  rX = simplex[best];
+  return fSimplex[best];
+}
+
+// refine the argmax of a grid search off the grid.  the search is restricted to the grid cells next to the argmax:
+// Brent's method if only one control has more than one grid point, bounded Nelder-Mead otherwise.
+// rMaxVal, rArgMaxArray are the result of the grid search on entry, and are only replaced by a better point.
+void refineArgmax(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray) {
+  int nGrids = controlGridArray.size();
+  if (nGrids == 0 || rArgMaxArray.size() != size_t(nGrids) || rMaxVal == -DBL_MAX) {
+    return;
+  }
+  // box around the argmax: the neighboring grid points along each control
+  DoubleVector lo(nGrids), hi(nGrids);
+  IntVector freeDims;
+  for (int d=0; d<nGrids; d++) {
+    DoublePyArray const &grid = controlGridArray[d];
+	int i = gridIndexOf(grid, rArgMaxArray[d]);
+	lo[d] = grid[std::max(i-1, 0)];
+	hi[d] = grid[std::min<int>(i+1, grid.size()-1)];
+	if (hi[d] > lo[d]) {
+	  freeDims.push_back(d);
+	}
+  }
+  if (freeDims.size() == 0) {
+    return;
+  }
+  ControlVector x(rArgMaxArray.begin(), rArgMaxArray.end());
+  double fx;
+  if (freeDims.size() == 1) {
+    int d = freeDims[0];
+	ControlVector args(rArgMaxArray.begin(), rArgMaxArray.end());
+	auto negObjective = [&] (double z) -> double {
+	  args[d] = z;
+	  return -params.objectiveFunction(args);
+	};
+	boost::uintmax_t nMaxIters = 100;
+	std::pair<double, double> result = boost::math::tools::brent_find_minima(negObjective, lo[d], hi[d], std::numeric_limits<double>::digits / 2, nMaxIters);
+	x[d] = result.first;
+	fx = -result.second;
+  } else {
+    fx = nelderMeadMax(params, lo, hi, x, rMaxVal, 200 * freeDims.size(), 1e-10);
+  }
+  if (fx > rMaxVal) {
+    rMaxVal = fx;
+	rArgMaxArray.assign(x.begin(), x.end());
+  }
 }
 
 bpl::tuple maximizer2d_wrapper(DoublePyArray const &controlGrid1, DoublePyArray const &controlGrid2, bpl::object const &params, bool bUseC, bool bParallel) {
@@ -513,37 +907,969 @@ void maximizer2d(DoublePyArray const &controlGrid1, DoublePyArray const &control
 // gridList is a sequence of grids for control vars
 // argList is a sequence of doubles, for the state vars
 // w.f is a multi-dimensional array
-void my_maximizer(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmaxArray, double &rMaxval, bool bParallel) {
+void my_maximizer(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmaxArray, double &rMaxval, bool bParallel, 
+  SearchModeT searchMode, bool bValidate, bool bRefine) {
   rCount = 0;
-   // if (controlGridArray.size() == 2) {
-     // double argmax1, argmax2;
-	 // rCount = gridSearch2DParallel(controlGridArray[0], controlGridArray[1], params, rMaxval, argmax1, argmax2);	
-	 // rArgmaxArray[0] = argmax1;
-	 // rArgmaxArray[1] = argmax1;
-   // } else {
-	  if (!bParallel) {
-		rCount = gridSearch(controlGridArray, params, rMaxval, rArgmaxArray);
-	  } else {
-		rCount = gridSearchParallel(controlGridArray, params, rMaxval, rArgmaxArray);
-	  }  
- // }
+  // monotone search needs the previous state, so it's only done in bellmanSweep
+  if (searchMode & SEARCH_CONCAVE) {
+    rCount = gridSearchConcave(controlGridArray, params, rMaxval, rArgmaxArray, 0, bValidate, bParallel);
+  } else if (!bParallel) {
+	rCount = gridSearch(controlGridArray, params, rMaxval, rArgmaxArray);
+  } else {
+	rCount = gridSearchParallel(controlGridArray, params, rMaxval, rArgmaxArray);
+  }  
+  if (bRefine) {
+    refineArgmax(controlGridArray, params, rMaxval, rArgmaxArray);
+  }
   return;
 }
 
-void my_maximizer2(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmaxArray, double &rMaxval, bool bParallel) {
-  int nGrids = controlGridArray.size();
-  unsigned int totalGridSize = 1;
-  double totalGridSize2 = 1.0;
-  for (int i=0; i<nGrids; i++) {
-	totalGridSize *= controlGridArray[i].size();
-	totalGridSize2 *= double(controlGridArray[i].size());
+// TBB body for the state loop of bellmanSweep.
+// with SEARCH_EXHAUSTIVE, the range is over state points and each one is maximized independently.
+// with SEARCH_MONOTONE, the range is over lines of the state grid along state dimension 0, and each line is solved by divide and
+// conquer (see solveLine)
+class BellmanSweepFnObj {
+public:
+  IntVector const &m_StateGridLens;
+  std::vector<DoubleVector> const &m_StateVarsArray;
+  std::vector<DoublePyArrayVector> const &m_ControlGridsArray;
+  BellmanParams const &m_params;
+  SearchModeT m_SearchMode;
+  bool m_bParallel;
+  double *m_pV;
+  std::vector<double*> const &m_PolicyPtrs;
+  
+  // number of lines along state dimension 0, i.e. the stride of dimension 0 in the flattened state grid
+  size_t nLines() const {
+    return m_StateVarsArray.size() / m_StateGridLens[0];
+  }
+
+  // maximize at one state point, store the results.  the search over control 0 is limited to indices [firstIndex0, endIndex0).
+  // returns the grid argmax of control 0, before refineArgmax() moves it off the grid, or -DBL_MAX if there's no max
+  double maximizeState(size_t index, size_t firstIndex0, size_t endIndex0, DoubleVector &argmax) const {
+    double maxval = -DBL_MAX;
+	int count;
+	BellmanStateContextPtr pState(m_params.newStateContext(m_StateVarsArray[index]));
+	BellmanStateCallParams callParams(m_params, *pState);
+	// inner loop over the control grid.  TBB will nest this inside the state loop
+	if (m_SearchMode & SEARCH_CONCAVE) {
+	  count = gridSearchConcave(m_ControlGridsArray[index], callParams, maxval, argmax, firstIndex0, m_params.m_bValidateSearch, m_bParallel, endIndex0);
+	} else if (m_bParallel) {
+	  count = gridSearchParallel(m_ControlGridsArray[index], callParams, maxval, argmax, firstIndex0, endIndex0);
+	} else {
+	  count = gridSearch(m_ControlGridsArray[index], callParams, maxval, argmax, firstIndex0, endIndex0);
+	}
+	if (count == 0) {
+	  // empty control grid: no max
+	  maxval = -DBL_MAX;
+	  argmax.assign(m_PolicyPtrs.size(), -DBL_MAX);
+	}
+	double gridArgmax0 = argmax.empty() ? -DBL_MAX : argmax[0];
+	if (m_params.m_bRefine) {
+	  refineArgmax(m_ControlGridsArray[index], callParams, maxval, argmax);
+	}
+	m_pV[index] = maxval;
+	for (unsigned int i=0; i<m_PolicyPtrs.size(); i++) {
+	  m_PolicyPtrs[i][index] = argmax[i];
+	}
+	return gridArgmax0;
+  }
+  
+  // monotone search over the states [lo, hi) of a line, whose argmax of control 0 is known to be in [argLo, argHi].
+  // the middle state is searched over that range, then the states below it only up to its argmax, and the states above it only
+  // from its argmax.  a line of N states with M points in control grid 0 takes O((N + M) log N) points of control 0 instead of N*M.
+  // the two halves are independent, so they run in parallel with bParallel.
+  // control grids can differ between states, so the limits are values, not indices.  a state with no control grids, or whose
+  // grid 0 isn't ascending, is searched over its whole grid and doesn't narrow the range of its neighbors
+  void solveLine(size_t line, int lo, int hi, double argLo, double argHi) const {
+    if (lo >= hi) {
+	  return;
+	}
+	int mid = lo + (hi - lo) / 2;
+	size_t index = mid * nLines() + line;
+	DoubleVector argmax(m_PolicyPtrs.size(), -DBL_MAX);
+	double argmax0 = -DBL_MAX;
+	DoublePyArrayVector const &controlGrids = m_ControlGridsArray[index];
+	if (controlGrids.size() == 0 || !std::is_sorted(controlGrids[0].begin(), controlGrids[0].end())) {
+	  maximizeState(index, 0, std::numeric_limits<size_t>::max(), argmax);
+	} else {
+	  DoublePyArray const &controlGrid0 = controlGrids[0];
+	  size_t firstIndex0 = 0, endIndex0 = controlGrid0.size();
+	  if (controlGrid0.size() > 0) {
+	    firstIndex0 = std::lower_bound(controlGrid0.begin(), controlGrid0.end(), argLo) - controlGrid0.begin();
+	    firstIndex0 = std::min<size_t>(firstIndex0, controlGrid0.size() - 1);
+	    endIndex0 = std::upper_bound(controlGrid0.begin(), controlGrid0.end(), argHi) - controlGrid0.begin();
+	    endIndex0 = std::max(endIndex0, firstIndex0 + 1);
+	  }
+	  argmax0 = maximizeState(index, firstIndex0, endIndex0, argmax);
+	}
+	// if there was no max, it says nothing about the neighbors
+	double splitLo = (argmax0 == -DBL_MAX) ? argHi : argmax0;
+	double splitHi = (argmax0 == -DBL_MAX) ? argLo : argmax0;
+	if (m_bParallel && hi - lo > 2) {
+	  parallel_invoke([&] { solveLine(line, lo, mid, argLo, splitLo); },
+	                  [&] { solveLine(line, mid+1, hi, splitHi, argHi); });
+	} else {
+	  solveLine(line, lo, mid, argLo, splitLo);
+	  solveLine(line, mid+1, hi, splitHi, argHi);
+	}
+  }
+  
+  void operator()( const blocked_range<size_t>& r ) const {
+	if (m_SearchMode & SEARCH_MONOTONE) {
+	  for( size_t line=r.begin(); line!=r.end(); ++line ){
+	    solveLine(line, 0, m_StateGridLens[0], -DBL_MAX, DBL_MAX);
+	  }
+	} else {
+	  DoubleVector argmax(m_PolicyPtrs.size(), -DBL_MAX);
+      for( size_t index=r.begin(); index!=r.end(); ++index ){
+	    maximizeState(index, 0, std::numeric_limits<size_t>::max(), argmax);
+	  }
+	}
+  }
+  BellmanSweepFnObj(IntVector const &stateGridLens, std::vector<DoubleVector> const &stateVarsArray, std::vector<DoublePyArrayVector> const &controlGridsArray, 
+    BellmanParams const &params, bool bParallel, double *pV, std::vector<double*> const &policyPtrs) :
+	m_StateGridLens(stateGridLens), m_StateVarsArray(stateVarsArray), m_ControlGridsArray(controlGridsArray), m_params(params), 
+	m_SearchMode(params.m_SearchMode), m_bParallel(bParallel), m_pV(pV), m_PolicyPtrs(policyPtrs)
+  {
+    // monotone search needs a state grid and a control to be monotone in
+	if ((m_SearchMode & SEARCH_MONOTONE) && (m_StateGridLens.size() == 0 || m_PolicyPtrs.size() == 0)) {
+	  m_SearchMode = SearchModeT(m_SearchMode & ~SEARCH_MONOTONE);
+	}
+  }
+};
+
+void bellmanSweep(IntVector const &stateGridLens, std::vector<DoubleVector> const &stateVarsArray, std::vector<DoublePyArrayVector> const &controlGridsArray, 
+  BellmanParams const &params, bool bParallel, double *pV, std::vector<double*> const &policyPtrs) {
+  assert(stateVarsArray.size() == controlGridsArray.size());
+  assert(params.hasStateObjectiveFunction());
+  if (stateVarsArray.size() == 0) {
+    return;
+  }
+  BellmanSweepFnObj fnObj(stateGridLens, stateVarsArray, controlGridsArray, params, bParallel, pV, policyPtrs);
+  // with monotone search, the range is over lines of the state grid, not state points
+  size_t rangeSize = stateVarsArray.size();
+  size_t statesPerItem = 1;
+  if (fnObj.m_SearchMode & SEARCH_MONOTONE) {
+    rangeSize = fnObj.nLines();
+	statesPerItem = stateGridLens[0];
+  }
+  if (bParallel) {
+    // average control grid size, to pick the grain size of the state loop
+	double avgControlGridSize = 0.0;
+	for (size_t i=0; i<controlGridsArray.size(); i++) {
+	  double gridSize = 1.0;
+	  for (size_t j=0; j<controlGridsArray[i].size(); j++) {
+	    gridSize *= double(controlGridsArray[i][j].size());
+	  }
+	  avgControlGridSize += gridSize / double(controlGridsArray.size());
+	}
+	size_t stateGrainSize = autoGrainSize(size_t(avgControlGridSize) * statesPerItem);
+	// state points and control points are split in the same arena: parallel_for over states, each one doing a nested
+	// parallel_reduce over its control grid.  TBB's work stealing balances the two levels, whichever one is larger
+	g_MaximizerArena.execute([&] {
+      parallel_for( blocked_range<size_t>(0, rangeSize, stateGrainSize), fnObj, auto_partitioner());
+	});
+  } else {
+    fnObj(blocked_range<size_t>(0, rangeSize));
+  }
+}
+
+void evaluatePolicy(std::vector<BellmanStateContextPtr> const &states, std::vector<double const*> const &policyPtrs, BellmanParams const &params,
+  bool bParallel, double *pV) {
+  assert(params.hasStateObjectiveFunction());
+  size_t nControls = policyPtrs.size();
+  auto fn = [&](blocked_range<size_t> const &r) {
+    ControlVector args(nControls);
+	for (size_t i=r.begin(); i<r.end(); i++) {
+	  for (size_t j=0; j<nControls; j++) {
+	    args[j] = policyPtrs[j][i];
+	  }
+	  pV[i] = params.objectiveFunction(*states[i], args);
+	}
+  };
+  if (bParallel) {
+    g_MaximizerArena.execute([&] {
+	  parallel_for(blocked_range<size_t>(0, states.size(), autoGrainSize(1)), fn, auto_partitioner());
+	});
+  } else {
+    fn(blocked_range<size_t>(0, states.size()));
+  }
+}
+
+// maximize over the rows of state i.  vals, lenArray, indexArray are scratch space
+template <class WT>
+double TransitionOperator::maximizeState(size_t i, WT const *pW, std::vector<double*> const &policyPtrs, DoubleVector &vals, IntVector &lenArray,
+  IntVector &indexArray) const {
+  size_t n = m_StateRowBegin[i+1] - m_StateRowBegin[i];
+  DoublePyArrayVector const &controlGrids = m_ControlGrids[i];
+  if (n == 0) {
+	for (size_t j=0; j<policyPtrs.size(); j++) {
+	  policyPtrs[j][i] = -DBL_MAX;
+	}
+	return -DBL_MAX;
+  }
+  vals.resize(n);
+  evalState(i, pW, &vals[0]);
+  double maxval;
+  size_t argmax;
+  argmaxWithCount(&vals[0], n, maxval, argmax);
+  // rows are in C order over the control grids
+  lenArray.resize(controlGrids.size());
+  indexArray.resize(controlGrids.size());
+  for (size_t j=0; j<controlGrids.size(); j++) {
+    lenArray[j] = controlGrids[j].size();
+  }
+  Index1DToArray(argmax, lenArray, indexArray);
+  for (size_t j=0; j<policyPtrs.size() && j<controlGrids.size(); j++) {
+    policyPtrs[j][i] = controlGrids[j][indexArray[j]];
+  }
+  return maxval;
+}
+
+void TransitionOperator::maximize(double const *pW, bool bParallel, double *pV, std::vector<double*> const &policyPtrs) const {
+  size_t nStateRows = nStates();
+  auto fn = [&](blocked_range<size_t> const &r) {
+    DoubleVector vals;
+	IntVector indexArray, lenArray;
+    for (size_t i=r.begin(); i<r.end(); i++) {
+	  pV[i] = maximizeState(i, pW, policyPtrs, vals, lenArray, indexArray);
+	}
+  };
+  if (bParallel) {
+    size_t avgRows = (nStateRows > 0) ? nRows() / nStateRows : 0;
+    g_MaximizerArena.execute([&] {
+	  parallel_for(blocked_range<size_t>(0, nStateRows, autoGrainSize(avgRows)), fn, auto_partitioner());
+	});
+  } else {
+    fn(blocked_range<size_t>(0, nStateRows));
+  }
+}
+
+template <class WT>
+double TransitionOperator::maximizeInPlaceRange(WT *pW, std::vector<size_t> const &order, size_t begin, size_t end,
+  std::vector<double*> const &policyPtrs) const {
+  DoubleVector vals;
+  IntVector indexArray, lenArray;
+  double maxChange = 0.0;
+  for (size_t k=begin; k<end; k++) {
+	size_t i = order[k];
+	double newVal = maximizeState(i, (WT const*) pW, policyPtrs, vals, lenArray, indexArray);
+	maxChange = std::max(maxChange, fabs(newVal - loadW(pW, i)));
+	storeW(pW, i, newVal);
+  }
+  return maxChange;
+}
+
+double TransitionOperator::maximizeInPlace(double *pW, std::vector<size_t> const &order, bool bParallel, std::vector<double*> const &policyPtrs) const {
+  if (m_nW != nStates()) throw std::logic_error("maximizeInPlace: W and the state points must be the same grid");
+  // order doesn't have to visit every state
+  for (size_t j=0; j<policyPtrs.size(); j++) {
+    std::fill(policyPtrs[j], policyPtrs[j] + nStates(), -DBL_MAX);
+  }
+  if (!bParallel) {
+    return maximizeInPlaceRange(pW, order, 0, order.size(), policyPtrs);
+  }
+  // other threads read W while it's being written, so the sweep works on a copy in atomics
+  std::vector<std::atomic<double> > atomicW(m_nW);
+  for (size_t i=0; i<m_nW; i++) {
+    atomicW[i].store(pW[i], std::memory_order_relaxed);
+  }
+  size_t avgRows = (nStates() > 0) ? nRows() / nStates() : 0;
+  double result = 0.0;
+  g_MaximizerArena.execute([&] {
+	result = parallel_reduce(blocked_range<size_t>(0, order.size(), autoGrainSize(avgRows)), 0.0,
+	  [&](blocked_range<size_t> const &r, double maxChange) -> double {
+	    return std::max(maxChange, maximizeInPlaceRange(&atomicW[0], order, r.begin(), r.end(), policyPtrs));
+	  },
+	  [](double a, double b) { return std::max(a, b); }, auto_partitioner());
+  });
+  for (size_t i=0; i<m_nW; i++) {
+    pW[i] = atomicW[i].load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+// rows of one state point, before they're concatenated into the operator
+struct TransitionStateRows {
+  DoubleVector m_RowConst;
+  std::vector<size_t> m_RowLen;
+  std::vector<unsigned int> m_Cols;
+  DoubleVector m_Vals;
+};
+
+// call params.transitionRow() and append the row's entries to rows.m_Cols, rows.m_Vals
+void appendTransitionRow(BellmanParams const &params, BellmanStateContext const &state, ControlVector const &args, size_t nW, TransitionEntries &entries,
+  double &rConst, size_t &rLen, TransitionStateRows &rows) {
+  entries.clear();
+  rConst = 0.0;
+  if (!params.transitionRow(state, args, rConst, entries)) {
+    throw std::logic_error("this problem doesn't support transition operators");
+  }
+  // merge repeated columns, e.g. shocks that land in the same cell
+  std::sort(entries.begin(), entries.end());
+  rLen = 0;
+  for (size_t e=0; e<entries.size(); e++) {
+    assert(entries[e].first < nW);
+	if (rLen > 0 && rows.m_Cols.back() == entries[e].first) {
+	  rows.m_Vals.back() += entries[e].second;
+	} else {
+	  rows.m_Cols.push_back((unsigned int) entries[e].first);
+	  rows.m_Vals.push_back(entries[e].second);
+	  rLen++;
+	}
+  }
+}
+
+void buildTransitions(IntVector const &stateGridLens, std::vector<DoubleVector> const &stateVarsArray, std::vector<DoublePyArrayVector> const &controlGridsArray,
+  BellmanParams const &params, size_t nW, bool bParallel, TransitionOperator &rOp) {
+  assert(stateVarsArray.size() == controlGridsArray.size());
+  if (nW >= size_t(UINT_MAX)) {
+    throw std::length_error("buildTransitions: W is too large");
+  }
+  size_t nStates = stateVarsArray.size();
+  std::vector<TransitionStateRows> stateRows(nStates);
+  auto fn = [&](blocked_range<size_t> const &r) {
+    TransitionEntries entries;
+	IntVector indexArray, lenArray;
+    for (size_t i=r.begin(); i<r.end(); i++) {
+	  DoublePyArrayVector const &controlGrids = controlGridsArray[i];
+	  size_t nControls = controlGrids.size();
+	  lenArray.resize(nControls);
+	  indexArray.resize(nControls);
+	  size_t nPoints = 1;
+	  for (size_t j=0; j<nControls; j++) {
+	    lenArray[j] = controlGrids[j].size();
+		nPoints *= lenArray[j];
+	  }
+	  BellmanStateContextPtr pState(params.newStateContext(stateVarsArray[i]));
+	  TransitionStateRows &rows = stateRows[i];
+	  rows.m_RowConst.resize(nPoints);
+	  rows.m_RowLen.resize(nPoints);
+	  ControlVector args(nControls);
+	  for (size_t k=0; k<nPoints; k++) {
+	    Index1DToArray(k, lenArray, indexArray);
+		for (size_t j=0; j<nControls; j++) {
+		  args[j] = controlGrids[j][indexArray[j]];
+		}
+		appendTransitionRow(params, *pState, args, nW, entries, rows.m_RowConst[k], rows.m_RowLen[k], rows);
+	  }
+	}
+  };
+  if (bParallel) {
+    g_MaximizerArena.execute([&] {
+	  parallel_for(blocked_range<size_t>(0, nStates, 1), fn, auto_partitioner());
+	});
+  } else {
+    fn(blocked_range<size_t>(0, nStates));
   }
-  // check that total grid space isn't too large to be indexed
-  assert(totalGridSize2 < double(UINT_MAX));
-  assert(nGrids > 0);
   
-  // calculate the objective function over every grid point
-  std::vector<double> fArray(totalGridSize);
+  // concatenate into CSR
+  rOp = TransitionOperator();
+  rOp.m_nW = nW;
+  rOp.m_StateGridLens = stateGridLens;
+  rOp.m_ControlGrids = controlGridsArray;
+  size_t nRows = 0, nEntries = 0;
+  for (size_t i=0; i<nStates; i++) {
+    nRows += stateRows[i].m_RowConst.size();
+	nEntries += stateRows[i].m_Cols.size();
+  }
+  rOp.m_StateRowBegin.reserve(nStates + 1);
+  rOp.m_RowBegin.reserve(nRows + 1);
+  rOp.m_RowConst.reserve(nRows);
+  rOp.m_Cols.reserve(nEntries);
+  rOp.m_Vals.reserve(nEntries);
+  for (size_t i=0; i<nStates; i++) {
+    TransitionStateRows &rows = stateRows[i];
+	for (size_t k=0; k<rows.m_RowLen.size(); k++) {
+	  rOp.m_RowBegin.push_back(rOp.m_RowBegin.back() + rows.m_RowLen[k]);
+	}
+	rOp.m_RowConst.insert(rOp.m_RowConst.end(), rows.m_RowConst.begin(), rows.m_RowConst.end());
+	rOp.m_Cols.insert(rOp.m_Cols.end(), rows.m_Cols.begin(), rows.m_Cols.end());
+	rOp.m_Vals.insert(rOp.m_Vals.end(), rows.m_Vals.begin(), rows.m_Vals.end());
+	rOp.m_StateRowBegin.push_back(rOp.m_RowConst.size());
+	DoubleVector().swap(rows.m_Vals);		// free as we go
+	std::vector<unsigned int>().swap(rows.m_Cols);
+  }
+}
+
+bpl::list stateVarsToList(DoubleVector const &stateVars) {
+  bpl::list result;
+  for (size_t j=0; j<stateVars.size(); j++) {
+    result.append(stateVars[j]);
+  }
+  return result;
+}
+// call params.getControlGridList() through python
+void getControlGrids(bpl::object const &params, bpl::list const &stateVarList, DoublePyArrayVector &rControlGrids) {
+  bpl::object controlGridList = params.attr("getControlGridList")(stateVarList);
+  rControlGrids.resize(bpl::len(controlGridList));
+  for (int j=0; j<bpl::len(controlGridList); j++) {
+    rControlGrids[j] = bpl::extract<DoublePyArray>(controlGridList[j]);
+  }
+}
+// the points of a tensor state grid, in C order.  fills in the grid sizes and returns the number of points
+size_t tensorStatePoints(bpl::list const &stateGridList, IntVector &rLenArray, std::vector<DoubleVector> &rStateVarsArray) {
+  int nStateVars = bpl::len(stateGridList);
+  DoublePyArrayVector stateGrids(nStateVars);
+  rLenArray.resize(nStateVars);
+  size_t nStates = 1;
+  for (int i=0; i<nStateVars; i++) {
+    stateGrids[i] = bpl::extract<DoublePyArray>(stateGridList[i]);
+	rLenArray[i] = stateGrids[i].size();
+	nStates *= rLenArray[i];
+  }
+  rStateVarsArray.assign(nStates, DoubleVector(nStateVars));
+  IntVector indexArray(nStateVars);
+  for (size_t index=0; index<nStates; index++) {
+    Index1DToArray(index, rLenArray, indexArray);
+	for (int j=0; j<nStateVars; j++) {
+	  rStateVarsArray[index][j] = stateGrids[j][indexArray[j]];
+	}
+  }
+  return nStates;
+}
+
+// maximize at every state point, the part shared by the python wrappers for tensor and sparse state grids.
+// getControlGridList() is called through python for each state point, since it's usually implemented in python.
+// lenArray is the shape of the state grid, empty if the points aren't on a tensor grid
+void sweepStatePoints(bpl::object const &params, IntVector const &lenArray, std::vector<DoubleVector> const &stateVarsArray,
+  bool bParallel, double *pV, std::vector<double*> const &policyPtrs) {
+  BellmanParams& p = bpl::extract<BellmanParams&>(params);
+  size_t nStates = stateVarsArray.size();
+  int nControls = policyPtrs.size();
+  int j;
+  // get control grids for every state point.  this needs the GIL, so it's done serially
+  std::vector<DoublePyArrayVector> controlGridsArray(nStates);
+  for (size_t index=0; index<nStates; index++) {
+	bpl::list stateVarList = stateVarsToList(stateVarsArray[index]);
+	getControlGrids(params, stateVarList, controlGridsArray[index]);
+	// the searches return one argmax per control grid
+	if (int(controlGridsArray[index].size()) != nControls) {
+	  PyErr_SetString(PyExc_ValueError, "bellmanSweep: getControlGridList() must return getNControls() grids");
+	  bpl::throw_error_already_set();
+	}
+	if (!p.hasStateObjectiveFunction()) {
+	  // objective function depends on setStateVars(), so we can't parallelize over states. do it here, one state at a time
+	  int count;
+	  double maxval;
+	  DoubleVector argmax(nControls, -DBL_MAX);
+	  params.attr("setStateVars")(stateVarList);
+	  my_maximizer(controlGridsArray[index], p, count, argmax, maxval, bParallel, p.m_SearchMode, p.m_bValidateSearch, p.m_bRefine);
+	  pV[index] = maxval;
+	  for (j=0; j<nControls; j++) {
+	    policyPtrs[j][index] = argmax[j];
+	  }
+	}
+  }
+  if (p.hasStateObjectiveFunction()) {
+    bellmanSweep(lenArray, stateVarsArray, controlGridsArray, p, bParallel, pV, policyPtrs);
+  }
+}
+
+// python wrapper for bellmanSweep, replaces the loop in bellman.py's grid_bellman().
+// stateGridList is a list of 1d arrays, WArray is the previous iteration on the state grid.
+// returns a tuple (V, [policy arrays]), same as grid_bellman()
+bpl::tuple bellmanSweep_wrapper(bpl::list const &stateGridList, bpl::object const &WArray, bpl::object const &params, bool bParallel) {
+  int i;
+  int nStateVars = bpl::len(stateGridList);
+  int nControls = bpl::extract<int>(params.attr("getNControls")());
+  IntVector lenArray;
+  std::vector<DoubleVector> stateVarsArray;
+  size_t nStates = tensorStatePoints(stateGridList, lenArray, stateVarsArray);
+  std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+  DoublePyArray W = bpl::extract<DoublePyArray>(WArray);
+  if (W.size() != nStates) {
+    PyErr_SetString(PyExc_ValueError, "bellmanSweep: W array doesn't match state grid size");
+    bpl::throw_error_already_set();
+  }
+  
+  // allocate output arrays, same shape as the state grid
+  DoublePyArray VArray(nStateVars, &dims[0]);
+  DoublePyArrayVector policyArrays(nControls);
+  std::vector<double*> policyPtrs(nControls);
+  for (i=0; i<nControls; i++) {
+    policyArrays[i] = DoublePyArray(nStateVars, &dims[0]);
+	policyPtrs[i] = policyArrays[i].array().data();
+  }
+  double *pV = VArray.array().data();
+  
+  params.attr("setPrevIteration")(stateGridList, WArray);
+  sweepStatePoints(params, lenArray, stateVarsArray, bParallel, pV, policyPtrs);
+  
+  bpl::list policyList;
+  for (i=0; i<nControls; i++) {
+    policyList.append(policyArrays[i]);
+  }
+  return bpl::make_tuple(VArray, policyList);
+}
+
+// policy evaluation sweeps for modified policy iteration: nSweeps times, call setPrevIteration(stateGridList, W) and set
+// W = the objective at each state point with the controls in policyList, which are arrays on the state grid (e.g. returned by bellmanSweep).
+// the control grids aren't searched, so a sweep costs one objective function call per state.  returns the last W
+DoublePyArray evaluatePolicy_wrapper(bpl::list const &stateGridList, bpl::object const &WArray, bpl::object const &params, bpl::list const &policyList,
+  int nSweeps, bool bParallel) {
+  BellmanParams& p = bpl::extract<BellmanParams&>(params);
+  int nControls = bpl::len(policyList);
+  IntVector lenArray;
+  std::vector<DoubleVector> stateVarsArray;
+  size_t nStates = tensorStatePoints(stateGridList, lenArray, stateVarsArray);
+  std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+  DoublePyArray W = bpl::extract<DoublePyArray>(WArray);
+  if (W.size() != nStates) {
+    PyErr_SetString(PyExc_ValueError, "evaluatePolicy: W array doesn't match state grid size");
+    bpl::throw_error_already_set();
+  }
+  DoublePyArrayVector policyArrays(nControls);
+  std::vector<double const*> policyPtrs(nControls);
+  for (int j=0; j<nControls; j++) {
+    policyArrays[j] = bpl::extract<DoublePyArray>(policyList[j]);
+	if (policyArrays[j].size() != nStates) {
+	  PyErr_SetString(PyExc_ValueError, "evaluatePolicy: policy array doesn't match state grid size");
+	  bpl::throw_error_already_set();
+	}
+	policyPtrs[j] = &policyArrays[j][0];
+  }
+  // the state contexts don't depend on W, so they're made once for all sweeps
+  std::vector<BellmanStateContextPtr> states;
+  if (p.hasStateObjectiveFunction()) {
+    states.resize(nStates);
+	for (size_t i=0; i<nStates; i++) {
+	  states[i].reset(p.newStateContext(stateVarsArray[i]));
+	}
+  }
+  for (int sweep=0; sweep<nSweeps; sweep++) {
+    // a new array each sweep, since setPrevIteration() may keep a reference to W
+    DoublePyArray VArray(dims.size(), &dims[0]);
+	double *pV = VArray.array().data();
+	params.attr("setPrevIteration")(stateGridList, W);
+	if (p.hasStateObjectiveFunction()) {
+	  evaluatePolicy(states, policyPtrs, p, bParallel, pV);
+	} else {
+	  ControlVector args(nControls);
+	  for (size_t i=0; i<nStates; i++) {
+	    params.attr("setStateVars")(stateVarsToList(stateVarsArray[i]));
+		for (int j=0; j<nControls; j++) {
+		  args[j] = policyPtrs[j][i];
+		}
+		pV[i] = p.objectiveFunction(args);
+	  }
+	}
+	W = VArray;
+  }
+  return W;
+}
+
+// Howard policy evaluation: the value of following the policy in policyList forever, V = r + A V, where row i of A and r come from
+// params.transitionRow() at state i with the policy's controls.  solves (I - A) V = r with BiCGSTAB, see solveIdentityMinus().
+// WArray is the initial guess, and is passed to setPrevIteration() so the problem knows the state grid.
+// returns (V, number of iterations, relative residual).  if the residual is not below tol, the solve failed and V is only the last iterate
+bpl::tuple solvePolicyValue_wrapper(bpl::list const &stateGridList, bpl::object const &WArray, bpl::object const &params, bpl::list const &policyList,
+  double tol, int maxIters, bool bParallel) {
+  BellmanParams& p = bpl::extract<BellmanParams&>(params);
+  int nControls = bpl::len(policyList);
+  IntVector lenArray;
+  std::vector<DoubleVector> stateVarsArray;
+  size_t nStates = tensorStatePoints(stateGridList, lenArray, stateVarsArray);
+  std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+  DoublePyArray W = bpl::extract<DoublePyArray>(WArray);
+  if (W.size() != nStates) {
+    PyErr_SetString(PyExc_ValueError, "solvePolicyValue: W array doesn't match state grid size");
+    bpl::throw_error_already_set();
+  }
+  DoublePyArrayVector policyArrays(nControls);
+  for (int j=0; j<nControls; j++) {
+    policyArrays[j] = bpl::extract<DoublePyArray>(policyList[j]);
+	if (policyArrays[j].size() != nStates) {
+	  PyErr_SetString(PyExc_ValueError, "solvePolicyValue: policy array doesn't match state grid size");
+	  bpl::throw_error_already_set();
+	}
+  }
+  params.attr("setPrevIteration")(stateGridList, WArray);
+  
+  // one row per state, built in parallel, then concatenated
+  std::vector<TransitionStateRows> stateRows(nStates);
+  auto fn = [&](blocked_range<size_t> const &r) {
+    TransitionEntries entries;
+	ControlVector args(nControls);
+	for (size_t i=r.begin(); i<r.end(); i++) {
+	  for (int j=0; j<nControls; j++) {
+	    args[j] = policyArrays[j][i];
+	  }
+	  BellmanStateContextPtr pState(p.newStateContext(stateVarsArray[i]));
+	  TransitionStateRows &rows = stateRows[i];
+	  rows.m_RowConst.resize(1);
+	  rows.m_RowLen.resize(1);
+	  appendTransitionRow(p, *pState, args, nStates, entries, rows.m_RowConst[0], rows.m_RowLen[0], rows);
+	}
+  };
+  if (bParallel) {
+    g_MaximizerArena.execute([&] {
+	  parallel_for(blocked_range<size_t>(0, nStates, autoGrainSize(1)), fn, auto_partitioner());
+	});
+  } else {
+    fn(blocked_range<size_t>(0, nStates));
+  }
+  SparseMatrixCSR A;
+  DoubleVector rhs(nStates);
+  for (size_t i=0; i<nStates; i++) {
+    TransitionStateRows const &rows = stateRows[i];
+	A.appendRow(rows.m_Cols.empty() ? (unsigned int const*) NULL : &rows.m_Cols[0], rows.m_Vals.empty() ? (double const*) NULL : &rows.m_Vals[0], rows.m_RowLen[0]);
+	rhs[i] = rows.m_RowConst[0];
+  }
+  stateRows.clear();
+  
+  DoubleVector V(W.begin(), W.end());
+  double residual;
+  int nIters;
+  if (bParallel) {
+    g_MaximizerArena.execute([&] {
+	  nIters = solveIdentityMinus(A, rhs, V, tol, maxIters, residual, true);
+	});
+  } else {
+    nIters = solveIdentityMinus(A, rhs, V, tol, maxIters, residual, false);
+  }
+  DoublePyArray VArray(dims.size(), &dims[0]);
+  std::copy(V.begin(), V.end(), VArray.array().data());
+  return bpl::make_tuple(VArray, nIters, residual);
+}
+
+// interpolate f, on the tensor grid grids1, at every point of the tensor grid grids2 (in C order) with InterpND<N>.
+// the points are interpolated a block at a time with interp_batch()
+template <int N>
+void interpolateTensorGrid(DoublePyArrayVector const &grids1, DoublePyArray const &f, DoublePyArrayVector const &grids2, double *pOut) {
+  InterpND<N> interp(grids1, f);
+  IntVector lenArray(N), indexArray(N);
+  size_t nPoints = 1;
+  for (int d=0; d<N; d++) {
+    lenArray[d] = grids2[d].size();
+	nPoints *= lenArray[d];
+  }
+  double points[INTERP_BATCH_POINTS * N];
+  for (size_t i0=0; i0<nPoints; i0+=INTERP_BATCH_POINTS) {
+    size_t m = std::min(INTERP_BATCH_POINTS, nPoints - i0);
+	for (size_t i=0; i<m; i++) {
+	  Index1DToArray(i0 + i, lenArray, indexArray);
+	  for (int d=0; d<N; d++) {
+	    points[i*N + d] = grids2[d][indexArray[d]];
+	  }
+	}
+	interp.interp_batch(points, m, pOut + i0);
+  }
+}
+
+// same as lininterp2.interpolateArray(gridList1, gridList2, f): f on the grids in gridList1, interpolated to the grids in gridList2.
+// points outside gridList1 are forced to the boundary
+DoublePyArray interpolateArray(DoublePyArrayVector const &grids1, DoublePyArray const &f, DoublePyArrayVector const &grids2) {
+  if (grids1.size() != grids2.size()) throw std::invalid_argument("interpolateArray: grid lists have different dimensions");
+  std::vector<npy_intp> dims(grids2.size());
+  for (size_t d=0; d<grids2.size(); d++) {
+    dims[d] = grids2[d].size();
+  }
+  DoublePyArray result(dims.size(), &dims[0]);
+  double *pResult = result.array().data();
+  switch (grids1.size()) {
+    case 1: interpolateTensorGrid<1>(grids1, f, grids2, pResult); break;
+	case 2: interpolateTensorGrid<2>(grids1, f, grids2, pResult); break;
+	case 3: interpolateTensorGrid<3>(grids1, f, grids2, pResult); break;
+	case 4: interpolateTensorGrid<4>(grids1, f, grids2, pResult); break;
+	default: throw std::invalid_argument("interpolateArray: only 1 to 4 dimensions are supported");
+  }
+  return result;
+}
+
+DoublePyArrayVector gridListToVector(bpl::list const &gridList) {
+  DoublePyArrayVector result(bpl::len(gridList));
+  for (size_t i=0; i<result.size(); i++) {
+    result[i] = bpl::extract<DoublePyArray>(gridList[i]);
+  }
+  return result;
+}
+
+DoublePyArray interpolateArray_wrapper(bpl::list const &gridList1, bpl::list const &gridList2, DoublePyArray const &f) {
+  return interpolateArray(gridListToVector(gridList1), f, gridListToVector(gridList2));
+}
+
+// result codes, same as bellman.py's ITER_RESULT_*
+enum IterResultT {
+  ITER_RESULT_CONVERGENCE = 0,
+  ITER_RESULT_MAX_ITERS = 1,
+  ITER_RESULT_MAX_TIME = 2,
+  ITER_RESULT_MAX_V = 3
+};
+
+// grid_valueIteration2 done natively: value iteration on each state grid in intermediateGrids (a list of stateGridLists) until
+// the largest relative change |V_new - V| / |V| is below the level's tolerance, then interpolate V to the next grid.
+// tolerance is a number, or a list with one per level.  nMaxIters (< 0 for no limit), maxTime (seconds, < 0 for no limit) are budgets
+// for all levels together, like grid_valueIteration2.  sweeps are native, see bellmanSweep_wrapper.
+// returns (result code, total iterations, V before the last sweep and V after it, both interpolated to initialGridList,
+// [policy arrays on the last grid], level stats),
+// level stats is a list of dicts with keys gridSize, nIter, seconds, interpSeconds, maxDiff
+bpl::tuple multigridValueIteration_wrapper(bpl::list const &intermediateGrids, bpl::list const &initialGridList, DoublePyArray const &initialVArray,
+  bpl::object const &params, bpl::object const &toleranceObj, int nMaxIters, double maxTime, double maxV, bool bParallel) {
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point beginTime = Clock::now();
+  int nControls = bpl::extract<int>(params.attr("getNControls")());
+  int nLevels = bpl::len(intermediateGrids);
+  bpl::extract<double> scalarTol(toleranceObj);
+  if (!scalarTol.check() && bpl::len(toleranceObj) != nLevels) {
+    PyErr_SetString(PyExc_ValueError, "multigridValueIteration: need one tolerance per level");
+    bpl::throw_error_already_set();
+  }
+  
+  DoublePyArrayVector prevGrids = gridListToVector(initialGridList);
+  DoublePyArray W = initialVArray;
+  DoublePyArray prevW = W;				// W before the last sweep
+  bpl::list policyList, levelStats;
+  int result = ITER_RESULT_CONVERGENCE;
+  int nIter = 0;
+  bool bStop = false;
+  for (int level=0; level<nLevels && !bStop; level++) {
+    Clock::time_point levelBegin = Clock::now();
+    bpl::list stateGridList = bpl::extract<bpl::list>(intermediateGrids[level]);
+	DoublePyArrayVector stateGrids = gridListToVector(stateGridList);
+	double tol = scalarTol.check() ? scalarTol() : bpl::extract<double>(toleranceObj[level]);
+	W = interpolateArray(prevGrids, W, stateGrids);
+	double interpSeconds = std::chrono::duration<double>(Clock::now() - levelBegin).count();
+	
+	IntVector lenArray;
+	std::vector<DoubleVector> stateVarsArray;
+	size_t nStates = tensorStatePoints(stateGridList, lenArray, stateVarsArray);
+	std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+	int levelIters = 0;
+	double maxDiff = 0.0;
+	while (true) {
+	  DoublePyArray VArray(dims.size(), &dims[0]);
+	  DoublePyArrayVector policyArrays(nControls);
+	  std::vector<double*> policyPtrs(nControls);
+	  for (int i=0; i<nControls; i++) {
+	    policyArrays[i] = DoublePyArray(dims.size(), &dims[0]);
+		policyPtrs[i] = policyArrays[i].array().data();
+	  }
+	  double *pV = VArray.array().data();
+	  params.attr("setPrevIteration")(stateGridList, W);
+	  sweepStatePoints(params, lenArray, stateVarsArray, bParallel, pV, policyPtrs);
+	  
+	  // same as defaultValueStoppingCriterion, NaNs (0/0) are skipped.  if they all are, there's nothing to converge
+	  maxDiff = 0.0;
+	  double Vmax = -DBL_MAX;
+	  size_t nValid = 0;
+	  for (size_t i=0; i<nStates; i++) {
+	    double pct = fabs((pV[i] - W[i]) / W[i]);
+		if (pct == pct) {
+		  maxDiff = std::max(maxDiff, pct);
+		  nValid++;
+		}
+		Vmax = std::max(Vmax, pV[i]);
+	  }
+	  if (nValid == 0 && nStates > 0) {
+	    PyErr_SetString(PyExc_ValueError, "multigridValueIteration: relative change in V is NaN at every state");
+		bpl::throw_error_already_set();
+	  }
+	  levelIters++;
+	  nIter++;
+	  prevW = W;
+	  W = VArray;
+	  policyList = bpl::list();
+	  for (int i=0; i<nControls; i++) {
+	    policyList.append(policyArrays[i]);
+	  }
+	  
+	  double elapsed = std::chrono::duration<double>(Clock::now() - beginTime).count();
+	  if (maxDiff < tol) {
+	    result = ITER_RESULT_CONVERGENCE;
+		break;
+	  }
+	  if (nMaxIters >= 0 && nIter > nMaxIters) {
+	    result = ITER_RESULT_MAX_ITERS;
+		bStop = true;
+	  }
+	  if (maxTime >= 0.0 && elapsed > maxTime) {
+	    result = ITER_RESULT_MAX_TIME;
+		bStop = true;
+	  }
+	  if (Vmax > maxV) {
+	    result = ITER_RESULT_MAX_V;
+		bStop = true;
+	  }
+	  if (bStop) {
+	    break;
+	  }
+	}
+	
+	bpl::list gridSize;
+	for (size_t d=0; d<lenArray.size(); d++) {
+	  gridSize.append(lenArray[d]);
+	}
+	bpl::dict stats;
+	stats["gridSize"] = gridSize;
+	stats["nIter"] = levelIters;
+	stats["seconds"] = std::chrono::duration<double>(Clock::now() - levelBegin).count();
+	stats["interpSeconds"] = interpSeconds;
+	stats["maxDiff"] = maxDiff;
+	levelStats.append(stats);
+	prevGrids = stateGrids;
+  }
+  DoublePyArrayVector initialGrids = gridListToVector(initialGridList);
+  DoublePyArray finalV1 = interpolateArray(prevGrids, prevW, initialGrids);
+  DoublePyArray finalV2 = interpolateArray(prevGrids, W, initialGrids);
+  return bpl::make_tuple(result, nIter, finalV1, finalV2, policyList, levelStats);
+}
+
+// same as bellmanSweep_wrapper, on the points of a sparse grid.  WArray holds the previous iteration at grid.points(),
+// and is passed to setPrevIterationSparse().  returns (V, [policy arrays]), 1d arrays in the same order
+bpl::tuple bellmanSweepSparse_wrapper(bpl::object const &gridObj, bpl::object const &WArray, bpl::object const &params, bool bParallel) {
+  SparseGrid const &grid = bpl::extract<SparseGrid const&>(gridObj);
+  int nControls = bpl::extract<int>(params.attr("getNControls")());
+  size_t nStates = grid.size();
+  DoublePyArray W = bpl::extract<DoublePyArray>(WArray);
+  if (W.size() != nStates) {
+    PyErr_SetString(PyExc_ValueError, "bellmanSweepSparse: W array doesn't match sparse grid size");
+    bpl::throw_error_already_set();
+  }
+  DoublePyArray VArray(nStates);
+  DoublePyArrayVector policyArrays(nControls);
+  std::vector<double*> policyPtrs(nControls);
+  for (int i=0; i<nControls; i++) {
+    policyArrays[i] = DoublePyArray(nStates);
+	policyPtrs[i] = policyArrays[i].array().data();
+  }
+  params.attr("setPrevIterationSparse")(gridObj, WArray);
+  sweepStatePoints(params, IntVector(), grid.points(), bParallel, VArray.array().data(), policyPtrs);
+  
+  bpl::list policyList;
+  for (int i=0; i<nControls; i++) {
+    policyList.append(policyArrays[i]);
+  }
+  return bpl::make_tuple(VArray, policyList);
+}
+
+// Gauss-Seidel version of bellmanSweepTransitions: WArray (a C-contiguous, writeable float64 array) is updated in place, state by state in the given order (flat C-order indices
+// into the state grid, each at most once; all states in C order if order is None), so each state sees the values already updated in this sweep.
+// with bParallel, the order is split between threads that update W at the same time (asynchronous value iteration).
+// returns (largest change in W, [policy arrays])
+bpl::tuple bellmanSweepTransitionsInPlace_wrapper(TransitionOperator const &op, bpl::object const &WArray, bpl::object const &orderObj, bool bParallel) {
+  // take the array itself, not a converted copy, so the updates are seen by the caller
+  PyArrayObject *pWArray = (PyArrayObject*) WArray.ptr();
+  if (!PyArray_Check(WArray.ptr()) || PyArray_TYPE(pWArray) != NPY_DOUBLE || !PyArray_ISCARRAY(pWArray) || !PyArray_ISNOTSWAPPED(pWArray)) {
+    PyErr_SetString(PyExc_TypeError, "bellmanSweepTransitionsInPlace: W must be a C-contiguous, writeable float64 array");
+    bpl::throw_error_already_set();
+  }
+  if (size_t(PyArray_SIZE(pWArray)) != op.sizeW()) {
+    PyErr_SetString(PyExc_ValueError, "bellmanSweepTransitionsInPlace: W array doesn't match the transition operator");
+    bpl::throw_error_already_set();
+  }
+  size_t nStates = op.nStates();
+  std::vector<size_t> order;
+  if (orderObj.ptr() == Py_None) {
+    order.resize(nStates);
+	for (size_t i=0; i<nStates; i++) {
+	  order[i] = i;
+	}
+  } else {
+    order.resize(bpl::len(orderObj));
+	// each state at most once: with bParallel, two threads on the same state would write its policy at the same time
+	std::vector<char> seen(nStates, 0);
+	for (size_t k=0; k<order.size(); k++) {
+	  long i = bpl::extract<long>(orderObj[k]);
+	  if (i < 0 || size_t(i) >= nStates) {
+	    PyErr_SetString(PyExc_IndexError, "bellmanSweepTransitionsInPlace: bad state index in order");
+		bpl::throw_error_already_set();
+	  }
+	  if (seen[i]) {
+	    PyErr_SetString(PyExc_ValueError, "bellmanSweepTransitionsInPlace: state index repeated in order");
+		bpl::throw_error_already_set();
+	  }
+	  seen[i] = 1;
+	  order[k] = i;
+	}
+  }
+  IntVector const &lenArray = op.stateGridLens();
+  std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+  int nControls = op.nControls();
+  DoublePyArrayVector policyArrays(nControls);
+  std::vector<double*> policyPtrs(nControls);
+  for (int i=0; i<nControls; i++) {
+    policyArrays[i] = DoublePyArray(dims.size(), &dims[0]);
+	policyPtrs[i] = policyArrays[i].array().data();
+  }
+  double maxChange = op.maximizeInPlace((double*) PyArray_DATA(pWArray), order, bParallel, policyPtrs);
+  
+  bpl::list policyList;
+  for (int i=0; i<nControls; i++) {
+    policyList.append(policyArrays[i]);
+  }
+  return bpl::make_tuple(maxChange, policyList);
+}
+
+// precompute the transition operator of params on a tensor state grid, with the control grids from getControlGridList().
+// WArray is only used for setPrevIteration(), so the problem knows the state grid; the operator works for any W on that grid
+TransitionOperator* buildTransitions_wrapper(bpl::list const &stateGridList, bpl::object const &WArray, bpl::object const &params, bool bParallel) {
+  BellmanParams& p = bpl::extract<BellmanParams&>(params);
+  IntVector lenArray;
+  std::vector<DoubleVector> stateVarsArray;
+  size_t nStates = tensorStatePoints(stateGridList, lenArray, stateVarsArray);
+  DoublePyArray W = bpl::extract<DoublePyArray>(WArray);
+  if (W.size() != nStates) {
+    PyErr_SetString(PyExc_ValueError, "buildTransitions: W array doesn't match state grid size");
+    bpl::throw_error_already_set();
+  }
+  params.attr("setPrevIteration")(stateGridList, WArray);
+  std::vector<DoublePyArrayVector> controlGridsArray(nStates);
+  for (size_t index=0; index<nStates; index++) {
+    getControlGrids(params, stateVarsToList(stateVarsArray[index]), controlGridsArray[index]);
+  }
+  std::unique_ptr<TransitionOperator> pOp(new TransitionOperator());
+  buildTransitions(lenArray, stateVarsArray, controlGridsArray, p, nStates, bParallel, *pOp);
+  return pOp.release();
+}
+
+// one Bellman iteration with a precomputed transition operator.  returns (V, [policy arrays]), same as bellmanSweep_wrapper
+bpl::tuple bellmanSweepTransitions_wrapper(TransitionOperator const &op, DoublePyArray const &W, bool bParallel) {
+  if (W.size() != op.sizeW()) {
+    PyErr_SetString(PyExc_ValueError, "bellmanSweepTransitions: W array doesn't match the transition operator");
+    bpl::throw_error_already_set();
+  }
+  IntVector const &lenArray = op.stateGridLens();
+  std::vector<npy_intp> dims(lenArray.begin(), lenArray.end());
+  int nControls = op.nControls();
+  DoublePyArray VArray(dims.size(), &dims[0]);
+  DoublePyArrayVector policyArrays(nControls);
+  std::vector<double*> policyPtrs(nControls);
+  for (int i=0; i<nControls; i++) {
+    policyArrays[i] = DoublePyArray(dims.size(), &dims[0]);
+	policyPtrs[i] = policyArrays[i].array().data();
+  }
+  op.maximize(&W[0], bParallel, VArray.array().data(), policyPtrs);
+  
+  bpl::list policyList;
+  for (int i=0; i<nControls; i++) {
+    policyList.append(policyArrays[i]);
+  }
+  return bpl::make_tuple(VArray, policyList);
+}
+
+// python interface to SparseGrid
+SparseGrid* newSparseGrid(DoublePyArray const &lo, DoublePyArray const &hi, int level) {
+  return new SparseGrid(DoubleVector(lo.begin(), lo.end()), DoubleVector(hi.begin(), hi.end()), level);
+}
+// an array of shape (size, dim), one point per row
+DoublePyArray sparseGridPoints(SparseGrid const &grid) {
+  npy_intp dims[2] = {(npy_intp) grid.size(), grid.dim()};
+  DoublePyArray result(2, dims);
+  double *pResult = result.array().data();
+  for (size_t k=0; k<grid.size(); k++) {
+    grid.point(k, pResult + k*grid.dim());
+  }
+  return result;
+}
+void sparseGridSetValues(SparseGrid &grid, DoublePyArray const &vals) {
+  if (vals.size() != grid.size()) throw std::invalid_argument("SparseGrid: wrong number of values");
+  grid.setValues(&vals[0]);
+}
+double sparseGridInterp(SparseGrid const &grid, DoublePyArray const &x) {
+  if (x.size() != (size_t) grid.dim()) throw std::invalid_argument("SparseGrid: wrong number of coordinates");
+  return grid.interp(&x[0]);
 }
 
 bpl::tuple my_maximizer_wrapper(bpl::list const &controlGridArrayList, bpl::object const &params, bool bParallel) {
@@ -557,8 +1883,17 @@ bpl::tuple my_maximizer_wrapper(bpl::list const &controlGridArrayList, bpl::obje
     controlGridArrays[i] = bpl::extract<DoublePyArray>(controlGridArrayList[i]);
   }
   MaximizerCallParams& p = bpl::extract<MaximizerCallParams&>(params);  
+  // BellmanParams carry a search mode
+  SearchModeT searchMode = SEARCH_EXHAUSTIVE;
+  bool bValidate = true, bRefine = false;
+  bpl::extract<BellmanParams&> bellmanParams(params);
+  if (bellmanParams.check()) {
+    searchMode = bellmanParams().m_SearchMode;
+	bValidate = bellmanParams().m_bValidateSearch;
+	bRefine = bellmanParams().m_bRefine;
+  }
   
-  my_maximizer(controlGridArrays, p, count, argmax, maxval, bParallel);
+  my_maximizer(controlGridArrays, p, count, argmax, maxval, bParallel, searchMode, bValidate, bRefine);
   bpl::list argmaxList;
   for (i=0; i<bpl::len(controlGridArrayList); i++) {
     argmaxList.append(argmax[i]);
@@ -567,7 +1902,7 @@ bpl::tuple my_maximizer_wrapper(bpl::list const &controlGridArrayList, bpl::obje
 }
 
 double MaximizerCallParams::objectiveFunction_wrap(bpl::list const &args) const {
-  DoubleVector args2(bpl::len(args));
+  ControlVector args2(bpl::len(args));
   for (int i=0; i<bpl::len(args); i++) {
 	args2[i] = bpl::extract<double>(args[i]);
   }	
@@ -579,21 +1914,21 @@ double MaximizerCallParams::objectiveFunction_wrap(bpl::list const &args) const
 class TestParamsArray: public MaximizerCallParams {
 public:
   // must be mt-safe. don't use boost::python handles!
-  double objectiveFunction(DoubleVector const &args) const {    
+  double objectiveFunction(ControlVector const &args) const {    
     double result=DBL_MAX, arg1, arg2, arg3;
     if (args.size() == 1) {
   	  arg1 = args[0];
-  	  result = interp1d_grid(m_pGrid1, m_pF, arg1);
+  	  result = interp1d_grid(m_Lookup1, m_pF, arg1);
     } else if (args.size() == 2) {
   	  arg1 = args[0];
 	  arg2 = args[1];		
-	  result = interp2d_grid(m_pGrid1, m_pGrid2, m_pF, arg1, arg2);		
+	  result = interp2d_grid(m_Lookup1, m_Lookup2, m_pF, arg1, arg2);		
 	  //printf("objectiveFn: %f %f -> %f\n", arg1, arg2, result);
     } else if (args.size() == 3) {
 	  arg1 = args[0];
 	  arg2 = args[1];
 	  arg3 = args[2];
-	  result = interp3d_grid(m_pGrid1, m_pGrid2, m_pGrid3, m_pF, arg1, arg2, arg3);		
+	  result = interp3d_grid(m_Lookup1, m_Lookup2, m_Lookup3, m_pF, arg1, arg2, arg3);		
     } else {
 	  assert(false);
     }
@@ -612,6 +1947,7 @@ public:
 	m_F = F;
 	m_pGrid1 = (PyArrayObject const*) m_grid1.data().handle().get();
 	m_pF = (PyArrayObject const*) m_F.data().handle().get();
+	m_Lookup1 = Grid1D(m_pGrid1);
   }
   void setFunctionArray2d(DoublePyArray const &grid1, DoublePyArray const &grid2, DoublePyArray const &F) {
     if (!(grid1.ndim() == 1 && grid2.ndim() == 1 && F.ndim() == 2 && grid1.size() * grid2.size() == F.size())) {
@@ -624,6 +1960,8 @@ public:
 	m_pGrid1 = (PyArrayObject const*) m_grid1.data().handle().get();
 	m_pGrid2 = (PyArrayObject const*) m_grid2.data().handle().get();
 	m_pF = (PyArrayObject const*) m_F.data().handle().get();	
+	m_Lookup1 = Grid1D(m_pGrid1);
+	m_Lookup2 = Grid1D(m_pGrid2);
   }
   void setFunctionArray3d(DoublePyArray const &grid1, DoublePyArray const &grid2, DoublePyArray const &grid3, DoublePyArray const &F) {
     if (!(grid1.ndim() == 1 && grid2.ndim() == 1 && grid3.ndim() == 1 && F.ndim() == 3 && grid1.size() * grid2.size() * grid3.size() == F.size())) {
@@ -638,6 +1976,9 @@ public:
 	m_pGrid2 = (PyArrayObject const*) m_grid2.data().handle().get();
 	m_pGrid3 = (PyArrayObject const*) m_grid3.data().handle().get();
 	m_pF = (PyArrayObject const*) m_F.data().handle().get();	
+	m_Lookup1 = Grid1D(m_pGrid1);
+	m_Lookup2 = Grid1D(m_pGrid2);
+	m_Lookup3 = Grid1D(m_pGrid3);
   }
     
   // the DoublePyArray objects will handle the reference counting.
@@ -645,6 +1986,7 @@ public:
   DoublePyArray m_grid1, m_grid2, m_grid3;  
   DoublePyArray m_F;
   PyArrayObject const *m_pGrid1, *m_pGrid2, *m_pGrid3, *m_pF;
+  Grid1D m_Lookup1, m_Lookup2, m_Lookup3;		// built when the grids are set
 };
 
 // objectiveFunction will call a python function
@@ -652,9 +1994,9 @@ public:
 class TestParamsFn: public MaximizerCallParams {
 public:
   // must be mt-safe. don't use boost::python handles!
-  double objectiveFunction(DoubleVector const &args) const {    
+  double objectiveFunction(ControlVector const &args) const {    
     bpl::list args2;
-	for (DoubleVector::const_iterator iter=args.begin(); iter != args.end(); iter++) {
+	for (ControlVector::const_iterator iter=args.begin(); iter != args.end(); iter++) {
 	  args2.append(*iter);
 	}
 	bpl::object result = m_CallbackFn(args2);
@@ -697,7 +2039,7 @@ bpl::list cartesianProduct(bpl::list const &gridArrayList) {
   bpl::list result;
   for (CartesianProductIterator iter = CartesianProduct_begin(gridArrays); iter != end; iter++) {
     bpl::list item;
-    DoubleVector prod = (*iter);
+    ControlVector const &prod = (*iter);
 	foreach(double x, prod) {
 	  //printf("%f\n", x);
 	  item.append(x);
@@ -723,6 +2065,17 @@ BOOST_PYTHON_MODULE(_maximizer)
   
   boost::python::def("maximizer2d", maximizer2d_wrapper);
   boost::python::def("maximizer", my_maximizer_wrapper);  
+  boost::python::def("bellmanSweep", bellmanSweep_wrapper);
+  boost::python::def("bellmanSweepSparse", bellmanSweepSparse_wrapper);
+  boost::python::def("evaluatePolicy", evaluatePolicy_wrapper);
+  boost::python::def("interpolateArray", interpolateArray_wrapper);
+  boost::python::def("multigridValueIteration", multigridValueIteration_wrapper);
+  boost::python::def("solvePolicyValue", solvePolicyValue_wrapper);
+  boost::python::def("buildTransitions", buildTransitions_wrapper, bpl::return_value_policy<bpl::manage_new_object>());
+  boost::python::def("bellmanSweepTransitions", bellmanSweepTransitions_wrapper);
+  boost::python::def("bellmanSweepTransitionsInPlace", bellmanSweepTransitionsInPlace_wrapper);
+  boost::python::def("setMaxThreads", setMaxThreads);
+  boost::python::def("getMaxThreads", getMaxThreads);
   
   bpl::class_<MaximizerCallParams, boost::noncopyable>("MaximizerCallParams", bpl::no_init)
 		.def("objectiveFunction", &MaximizerCallParams::objectiveFunction_wrap)
@@ -741,7 +2094,39 @@ BOOST_PYTHON_MODULE(_maximizer)
 		.def("getControlGridList", &BellmanParams::getControlGridList)
 		.def("getNControls", &BellmanParams::getNControls)
 		.def("setPrevIteration", &BellmanParams::setPrevIteration)
+		.def("hasStateObjectiveFunction", &BellmanParams::hasStateObjectiveFunction)
+		.def_readwrite("searchMode", &BellmanParams::m_SearchMode)
+		.def_readwrite("validateSearch", &BellmanParams::m_bValidateSearch)
+		.def_readwrite("refine", &BellmanParams::m_bRefine)
+		.def_readwrite("interpKind", &BellmanParams::m_InterpKind)
+		.def("setPrevIterationSparse", &BellmanParams::setPrevIterationSparse)
+	;
+  bpl::class_<SparseGrid>("SparseGrid", bpl::no_init)
+		.def("__init__", bpl::make_constructor(newSparseGrid))
+		.def("size", &SparseGrid::size)
+		.def("dim", &SparseGrid::dim)
+		.def("level", &SparseGrid::level)
+		.def("points", sparseGridPoints)
+		.def("setValues", sparseGridSetValues)
+		.def("__call__", sparseGridInterp)
+	;
+  bpl::class_<TransitionOperator, boost::noncopyable>("TransitionOperator", bpl::no_init)
+		.def("nStates", &TransitionOperator::nStates)
+		.def("nRows", &TransitionOperator::nRows)
+		.def("nEntries", &TransitionOperator::nEntries)
+		.def("memoryBytes", &TransitionOperator::memoryBytes)
+	;
+  bpl::enum_<SearchModeT>("SearchModeT")
+        .value("SEARCH_EXHAUSTIVE", SEARCH_EXHAUSTIVE)
+		.value("SEARCH_MONOTONE", SEARCH_MONOTONE)
+		.value("SEARCH_CONCAVE", SEARCH_CONCAVE)
+		.value("SEARCH_MONOTONE_CONCAVE", SEARCH_MONOTONE_CONCAVE)
 	;	
+  bpl::enum_<InterpKindT>("InterpKindT")
+        .value("INTERP_LINEAR", INTERP_LINEAR)
+		.value("INTERP_MONOTONE_CUBIC", INTERP_MONOTONE_CUBIC)
+		.value("INTERP_SCHUMAKER", INTERP_SCHUMAKER)
+	;
   
   bpl::class_<hello>("hello", bpl::init<std::string>())
         .def("greet", &hello::greet)  // Add a regular member function.        
@@ -21,10 +21,14 @@
 #include <string>
 #include <vector>
 #include <limits>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 
 #include <pyublas/numpy.hpp>
 #include "myTypes.h"
 #include "myFuncs.h"
+#include "sparseGrid.h"
 
 // maximize a function over a grid of control variables.
 
@@ -34,18 +38,70 @@ namespace bpl = boost::python;
 // specific problems should inherit from this class
 class MaximizerCallParams {
 public:
-  virtual double objectiveFunction(DoubleVector const &args) const = 0;				// this calculates the objective function.  it must be MT-safe, so it doesn't take python objects as args
+  virtual double objectiveFunction(ControlVector const &args) const = 0;				// this calculates the objective function.  it must be MT-safe, so it doesn't take python objects as args
   double objectiveFunction_wrap(boost::python::list const &args) const; 			// this wraps objectiveFunction() for python
+  // evaluate the objective function at n points.  controls holds the points one after another, nArgs doubles each.
+  // the default calls objectiveFunction() on each point.  problems can override it to share work between points.
+  // the exhaustive grid searches evaluate the control grid in blocks with this
+  virtual void objectiveFunctionBatch(double const *controls, size_t nArgs, size_t n, double *out) const {
+    ControlVector args(nArgs);
+	for (size_t i=0; i<n; i++) {
+	  std::copy(controls + i*nArgs, controls + (i+1)*nArgs, args.begin());
+	  out[i] = objectiveFunction(args);
+	}
+  }
   
   virtual ~MaximizerCallParams() {}
 };
 
+// how bellmanSweep searches the control grid at each state point.  these are bit flags
+enum SearchModeT {
+  SEARCH_EXHAUSTIVE = 0,		// evaluate the objective at every control grid point
+  SEARCH_MONOTONE = 1,			// optimal control 0 is increasing in state 0: bound each state's search by the argmaxes of states already solved
+  SEARCH_CONCAVE = 2,			// objective is concave in the controls: find the max by nested bisection
+  SEARCH_MONOTONE_CONCAVE = 3
+};
+
+// per-call state of a Bellman problem: the state variables at one state point, plus anything the problem wants to precompute
+// from them.  problems can derive from this and override BellmanParams::newStateContext().
+// each state point gets its own context, so the BellmanParams object itself holds only immutable problem data, and
+// different state points can be evaluated on different threads.
+class BellmanStateContext {
+public:
+  BellmanStateContext(DoubleVector const &stateVars) : m_StateVars(stateVars) {}
+  virtual ~BellmanStateContext() {}
+  DoubleVector m_StateVars;
+};
+typedef std::shared_ptr<BellmanStateContext> BellmanStateContextPtr;
+
+// (index into W, weight) pairs of one row of a transition operator
+typedef std::vector<std::pair<size_t, double> > TransitionEntries;
+
 // this object is for use in solving Bellman equations with value or policy iteration.
 // these methods are exposed to python
 class BellmanParams : public MaximizerCallParams {
 public:
-  virtual double objectiveFunction(DoubleVector const &args) const { return std::numeric_limits<double>::quiet_NaN(); }
+  BellmanParams() : m_SearchMode(SEARCH_EXHAUSTIVE), m_bValidateSearch(true), m_bRefine(false), m_InterpKind(INTERP_LINEAR) {}
+  // objective function at the state set by setStateVars(). not MT-safe across states, since the state is shared
+  virtual double objectiveFunction(ControlVector const &args) const {
+    if (!m_pStateContext) {
+	  return std::numeric_limits<double>::quiet_NaN();
+	}
+    return objectiveFunction(*m_pStateContext, args);
+  }
+  virtual void objectiveFunctionBatch(double const *controls, size_t nArgs, size_t n, double *out) const {
+    if (!m_pStateContext) {
+	  std::fill(out, out + n, std::numeric_limits<double>::quiet_NaN());
+	  return;
+	}
+	objectiveFunctionBatch(*m_pStateContext, controls, nArgs, n, out);
+  }
   virtual void setStateVars(boost::python::list const &stateVars) {		// set the state variables used in objectiveFunction()
+    DoubleVector stateVars2(bpl::len(stateVars));
+	for (unsigned int i=0; i<stateVars2.size(); i++) {
+	  stateVars2[i] = bpl::extract<double>(stateVars[i]);
+	}
+	m_pStateContext.reset(newStateContext(stateVars2));
   }
   virtual bpl::list getControlGridList(bpl::list const &stateVars) const {		// return a list of arrays that hold the grid for the control variables
     bpl::list result;
@@ -56,23 +112,196 @@ public:
   }
   virtual void setPrevIteration(bpl::list const &stateGridList, DoublePyArray const &WArray) {		// set the previous value function.
   }
+  // set the previous value function on a sparse grid.  WArray holds its values at grid.points()
+  virtual void setPrevIterationSparse(SparseGrid const &grid, DoublePyArray const &WArray) {
+    throw std::logic_error("this problem doesn't support sparse grids");
+  }
+  // problems that implement objectiveFunction(state, controls) should return true here.
+  // then bellmanSweep() can maximize different state points on different threads
+  virtual bool hasStateObjectiveFunction() const {
+    return false;
+  }
+  // create the per-call state context for a state point.  caller owns the result
+  virtual BellmanStateContext* newStateContext(DoubleVector const &stateVars) const {
+    return new BellmanStateContext(stateVars);
+  }
+  // calculate the objective function at the given state.  must be MT-safe, and must not modify the BellmanParams object
+  virtual double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const { return std::numeric_limits<double>::quiet_NaN(); }
+  // batch version of objectiveFunction(state, controlVars), see MaximizerCallParams::objectiveFunctionBatch()
+  virtual void objectiveFunctionBatch(BellmanStateContext const &state, double const *controls, size_t nArgs, size_t n, double *out) const {
+    ControlVector args(nArgs);
+	for (size_t i=0; i<n; i++) {
+	  std::copy(controls + i*nArgs, controls + (i+1)*nArgs, args.begin());
+	  out[i] = objectiveFunction(state, args);
+	}
+  }
+  // the objective as an affine function of the previous iteration W: const + sum of weight * W[index], with W flattened in C order.
+  // problems whose objective is a reward plus a discounted expectation of interpolated W can return their interpolation weights here,
+  // so that buildTransitions() can precompute them once for a fixed control grid.  returns false if not supported
+  virtual bool transitionRow(BellmanStateContext const &state, ControlVector const &controlVars, double &rConst, TransitionEntries &rEntries) const {
+    return false;
+  }
+  // the state variables of the last setStateVars() call
+  DoubleVector const &getStateVars() const {
+    if (!m_pStateContext) throw std::logic_error("setStateVars() has not been called");
+    return m_pStateContext->m_StateVars;
+  }
   virtual ~BellmanParams() {}
+  
+  BellmanStateContextPtr m_pStateContext;
+  SearchModeT m_SearchMode;				// used by bellmanSweep and the python maximizer
+  bool m_bValidateSearch;				// with SEARCH_CONCAVE, check the result and fall back to an exhaustive search if the objective isn't concave
+  bool m_bRefine;						// after the grid search, refine the argmax between grid points with refineArgmax()
+  InterpKindT m_InterpKind;				// how subclasses interpolate the previous iteration, if they support it.  used by the next setPrevIteration()
+};
+
+// binds a state context to a BellmanParams object, so that the maximizer can be called on it without calling setStateVars()
+class BellmanStateCallParams : public MaximizerCallParams {
+public:
+  BellmanStateCallParams(BellmanParams const &params, BellmanStateContext const &state)
+  : m_params(params), m_State(state) {
+  }
+  double objectiveFunction(ControlVector const &args) const {
+    return m_params.objectiveFunction(m_State, args);
+  }
+  void objectiveFunctionBatch(double const *controls, size_t nArgs, size_t n, double *out) const {
+    m_params.objectiveFunctionBatch(m_State, controls, nArgs, n, out);
+  }
+  BellmanParams const &m_params;
+  BellmanStateContext const &m_State;
 };
 
-int gridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray);
-int gridSearchParallel(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray);
+// number of threads used by gridSearchParallel and bellmanSweep.  0 means the TBB default
+void setMaxThreads(int nThreads);
+int getMaxThreads();
+
+// the search over control 0 is limited to indices [firstIndex0, endIndex0)
+int gridSearch(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0=0,
+  size_t endIndex0=std::numeric_limits<size_t>::max());
+int gridSearchParallel(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0=0,
+  size_t endIndex0=std::numeric_limits<size_t>::max());
+// for concave objective functions. O(log M) objective function calls per control instead of M.
+// with bValidate, falls back to gridSearch (gridSearchParallel if bParallel) if the result isn't a local max
+int gridSearchConcave(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray, size_t firstIndex0=0,
+  bool bValidate=true, bool bParallel=false, size_t endIndex0=std::numeric_limits<size_t>::max());
+// improve the result of a grid search by searching continuously in the grid cells around the argmax.
+// Brent's method if only one control grid has more than one point, bounded Nelder-Mead otherwise.
+// the result is only replaced if the objective function is higher
+void refineArgmax(DoublePyArrayVector const &controlGridArray, MaximizerCallParams &params, double &rMaxVal, DoubleVector &rArgMaxArray);
 
 // maximize an objective function over a 2-dimensional grid of control variables.
 // return values: count (multiplicity), control1, control2, maxval (value of objective function)
 void maximizer2d(DoublePyArray const &controlGrid1, DoublePyArray const &controlGrid2, MaximizerCallParams &params, int &rCount, double &rControl1, double &rControl2, double &rMaxval,
   bool bUseC, bool bParallel);
 
+// exhaustive search over the control grid using params.objectiveFunctionBatch(), which evaluates blocks of grid points at once.
+// gridSearch and gridSearchParallel call this.  the search over control 0 is limited to indices [firstIndex0, endIndex0)
+void my_maximizer2(DoublePyArrayVector const &controlGrids, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmax, double &rMaxval, bool bParallel,
+  size_t firstIndex0=0, size_t endIndex0=std::numeric_limits<size_t>::max());
+
 // same as maximizer2d, but for an arbitrary number of dimensions
 // controlGrids is a std::vector of DoublePyArrays
-void my_maximizer(DoublePyArrayVector const &controlGrids, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmax, double &rMaxval);
+void my_maximizer(DoublePyArrayVector const &controlGrids, MaximizerCallParams &params, int &rCount, DoubleVector &rArgmax, double &rMaxval, bool bParallel,
+  SearchModeT searchMode=SEARCH_EXHAUSTIVE, bool bValidate=true, bool bRefine=false);
+
+// bellman operator over a whole state grid, done natively.
+// stateGridLens are the sizes of the state grids.  stateVarsArray holds the state variables at every state point (in C order over the state grid), 
+// controlGridsArray the control grids at each point.
+// params must have hasStateObjectiveFunction() == true.  params.m_SearchMode selects how the control grid is searched, params.m_bRefine whether the argmax is refined off the grid.
+// maxval at each point goes into pV, argmax for control i goes into policyPtrs[i]
+void bellmanSweep(IntVector const &stateGridLens, std::vector<DoubleVector> const &stateVarsArray, std::vector<DoublePyArrayVector> const &controlGridsArray, 
+  BellmanParams const &params, bool bParallel, double *pV, std::vector<double*> const &policyPtrs);
 
 
+// apply a fixed policy instead of maximizing: pV[i] = objective at state i with control j = policyPtrs[j][i].
+// params must have hasStateObjectiveFunction() == true.  used by modified policy iteration between full sweeps
+void evaluatePolicy(std::vector<BellmanStateContextPtr> const &states, std::vector<double const*> const &policyPtrs, BellmanParams const &params,
+  bool bParallel, double *pV);
+
+// the objective function of a Bellman problem at every (state, control grid point), precomputed by buildTransitions() as a sparse
+// affine function of the previous iteration W, stored as a CSR matrix with one row per (state, control grid point).
+// for a fixed control grid the interpolation cells and weights are the same in every iteration, so a Bellman iteration is then
+// a sparse matrix-vector product followed by an argmax per state
+class TransitionOperator {
+public:
+  TransitionOperator() : m_nW(0) {
+    m_StateRowBegin.push_back(0);
+	m_RowBegin.push_back(0);
+  }
+  size_t nStates() const {
+    return m_ControlGrids.size();
+  }
+  size_t nRows() const {
+    return m_RowConst.size();
+  }
+  size_t nEntries() const {
+    return m_Vals.size();
+  }
+  size_t sizeW() const {
+    return m_nW;
+  }
+  size_t memoryBytes() const {
+    return m_Cols.size() * sizeof(unsigned int) + m_Vals.size() * sizeof(double) + m_RowConst.size() * sizeof(double) + m_RowBegin.size() * sizeof(size_t);
+  }
+  IntVector const &stateGridLens() const {
+    return m_StateGridLens;
+  }
+  size_t nControls() const {
+    return m_ControlGrids.empty() ? 0 : m_ControlGrids[0].size();
+  }
+  // W is read through these, so the in-place sweep can keep it in atomics while other threads update it
+  static double loadW(double const *pW, size_t k) {
+    return pW[k];
+  }
+  static double loadW(std::atomic<double> const *pW, size_t k) {
+    return pW[k].load(std::memory_order_relaxed);
+  }
+  static void storeW(double *pW, size_t k, double x) {
+    pW[k] = x;
+  }
+  static void storeW(std::atomic<double> *pW, size_t k, double x) {
+    pW[k].store(x, std::memory_order_relaxed);
+  }
+  // objective of every control grid point at state i, in C order over the control grids.  WT is double or std::atomic<double>
+  template <class WT>
+  void evalState(size_t i, WT const *pW, double *out) const {
+    for (size_t r=m_StateRowBegin[i]; r<m_StateRowBegin[i+1]; r++) {
+	  double sum = m_RowConst[r];
+	  for (size_t k=m_RowBegin[r]; k<m_RowBegin[r+1]; k++) {
+	    sum += m_Vals[k] * loadW(pW, m_Cols[k]);
+	  }
+	  out[r - m_StateRowBegin[i]] = sum;
+	}
+  }
+  // one Bellman iteration: maxval at each state into pV, argmax for control j into policyPtrs[j]
+  void maximize(double const *pW, bool bParallel, double *pV, std::vector<double*> const &policyPtrs) const;
+  // Gauss-Seidel sweep: visit the states in the given order (no state twice) and update W in place, so later states see the new values.
+  // W must be on the same grid as the state points.  with bParallel, threads take different parts of the order at once and
+  // read each other's updates as they happen (asynchronous value iteration), so the result depends on the scheduling; W is
+  // copied into relaxed atomics for the sweep.  states not in order keep their W and get a policy of -DBL_MAX.
+  // returns the largest change in W
+  double maximizeInPlace(double *pW, std::vector<size_t> const &order, bool bParallel, std::vector<double*> const &policyPtrs) const;
+
+  template <class WT>
+  double maximizeState(size_t i, WT const *pW, std::vector<double*> const &policyPtrs, DoubleVector &vals, IntVector &lenArray, IntVector &indexArray) const;
+  // the part of maximizeInPlace() from order[begin] to order[end-1]
+  template <class WT>
+  double maximizeInPlaceRange(WT *pW, std::vector<size_t> const &order, size_t begin, size_t end, std::vector<double*> const &policyPtrs) const;
+
+  size_t m_nW;									// size of W
+  IntVector m_StateGridLens;
+  std::vector<DoublePyArrayVector> m_ControlGrids;	// control grids at each state
+  std::vector<size_t> m_StateRowBegin;			// first row of each state, plus one past the end
+  std::vector<size_t> m_RowBegin;				// first entry of each row, plus one past the end
+  std::vector<unsigned int> m_Cols;
+  DoubleVector m_Vals;
+  DoubleVector m_RowConst;
+};
 
+// precompute the transition operator of params at the given state points, over the control grids at each point.
+// params.transitionRow() must be supported, and setPrevIteration() must have been called so the problem knows its state grid
+void buildTransitions(IntVector const &stateGridLens, std::vector<DoubleVector> const &stateVarsArray, std::vector<DoublePyArrayVector> const &controlGridsArray,
+  BellmanParams const &params, size_t nW, bool bParallel, TransitionOperator &rOp);
 
 	
 #endif //_maximizer_h
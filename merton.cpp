@@ -41,6 +41,7 @@ MertonParams::MertonParams(DoublePyArray stateGrid, double gamma, double delta,
 {
 	  m_StateGrid = stateGrid;
 	  m_pStateGrid = (PyArrayObject const*) m_StateGrid.data().handle().get();
+	  m_StateGridLookup = Grid1D(m_pStateGrid);
 	  m_gamma = gamma;
 	  assert(gamma >= 1.0);
 	  if (gamma == 1.0) {	// log utility
@@ -91,29 +92,36 @@ double MertonParams::calcEV_grid (double cf, double s, double W) const {
   ddFnObj pdfFn = boost::bind(truncateIfLessThanZero, m_PDFFn, _1);
   double EV = -DBL_MAX;
   if (s*(1.0-cf)*W == 0.0) {   // zero invested in risky asset
-    EV = interp1d_grid(m_pStateGrid, m_pPrevIterationArray, Z_to_nextW(s, cf, m_riskfree_r, m_dt, W, 0.0));
+    EV = interp1d_grid(m_StateGridLookup, m_pPrevIterationArray, Z_to_nextW(s, cf, m_riskfree_r, m_dt, W, 0.0));
   } else {
     EV = calculateEV_grid(m_pStateGrid, m_pPrevIterationArray, cdfFn, pdfFn, inverseFn, m_PrevIteration[0], m_PrevIteration[m_PrevIteration.size()-1]);
   }
   return EV;
 }
 
-double calcEV_helper(double cf, double s, double r, double dt, double W, PyArrayObject const *pGrid, PyArrayObject const *pPrev, double z) {
-  double nextW = Z_to_nextW(s, cf, r, dt, W, z);
-  double nextV = interp1d_grid(pGrid, pPrev, nextW);
-  return nextV;
-}
-
 double MertonParams::calcEV_montecarlo (double cf, double s, double W) const {
-  ddFnObj nextVFn = boost::bind(calcEV_helper, cf, s, m_riskfree_r, m_dt, W, m_pStateGrid, m_pPrevIterationArray, _1);
-  double EV = calculateEV_montecarlo_1d(nextVFn, m_RandomDraws);
-  return EV;
+  // map a block of draws to next period's wealth, then interpolate the block in one call
+  double nextW[INTERP_BATCH_POINTS], nextV[INTERP_BATCH_POINTS];
+  double const *pPrev = &m_PrevIteration[0];
+  size_t nDraws = m_RandomDraws.size();
+  double sum = 0.0;
+  for (size_t i0=0; i0<nDraws; i0+=INTERP_BATCH_POINTS) {
+    size_t m = std::min(INTERP_BATCH_POINTS, nDraws - i0);
+	for (size_t i=0; i<m; i++) {
+	  nextW[i] = Z_to_nextW(s, cf, m_riskfree_r, m_dt, W, m_RandomDraws[i0 + i]);
+	}
+	interp1d_grid_batch(m_StateGridLookup, pPrev, nextW, m, nextV);
+	for (size_t i=0; i<m; i++) {
+	  sum += nextV[i];
+	}
+  }
+  return sum / nDraws;
 }
 
-double MertonParams::objectiveFunction(DoubleVector const &controlVars) const {
+double MertonParams::objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const {
   double cf = controlVars[0];		// fraction of wealth consumed
   double s = controlVars[1];		// fraction of wealth invested in risky asset
-  double W = m_wealth;				// wealth
+  double W = state.m_StateVars[0];	// wealth
   double EV = -DBL_MAX;
   if (m_bUseMonteCarlo == true) {  
     EV = calcEV_montecarlo(cf, s, W);
@@ -125,12 +133,12 @@ double MertonParams::objectiveFunction(DoubleVector const &controlVars) const {
 }
 
 double MertonParams::u (double cf, double s) const {
-  double W = m_wealth;				// wealth
+  double W = getStateVars()[0];		// wealth
   return m_uFn(cf*W);
 }
 
 double MertonParams::EV (double cf, double s) const {
-  double W = m_wealth;				// wealth
+  double W = getStateVars()[0];		// wealth
   double EV = -DBL_MAX;
   if (m_bUseMonteCarlo == true) {  
     EV = calcEV_montecarlo(cf, s, W);
@@ -144,7 +152,9 @@ double MertonParams::EV (double cf, double s) const {
 double MertonParams::EV_raw () const {
   double EV = -DBL_MAX;
   if (m_bUseMonteCarlo == true) {  
-    ddFnObj Vfn = boost::bind(interp1d_grid, m_pStateGrid, m_pPrevIterationArray, _1);
+    Grid1D const &grid = m_StateGridLookup;
+	PyArrayObject const *pPrev = m_pPrevIterationArray;
+    ddFnObj Vfn = [=] (double x) { return interp1d_grid(grid, pPrev, x); };
 	EV = calculateEV_montecarlo_1d(Vfn, m_RandomDraws);
   } else {
     ddFnObj cdfFn = boost::bind(truncateIfLessThanZero, m_CDFFn, _1);		// boost lognormal cdf won't take arg < 0
@@ -25,7 +25,7 @@ namespace bpl = boost::python;
 
 class MertonParams: public BellmanParams {
   public:
-    double objectiveFunction(DoubleVector const &args) const;
+    double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const;
 	
 	// gamma - CRRA utility parameter (1 for log utility)
 	// delta - continuous discount factor
@@ -38,9 +38,8 @@ class MertonParams: public BellmanParams {
 	double EV_raw () const;
 	
 	// methods inherited from BellmanParams
-	void setStateVars(bpl::list const &stateVars) {
-	  m_wealth = bpl::extract<double>(stateVars[0]);
-	}
+	// state var: wealth
+	bool hasStateObjectiveFunction() const { return true; }
 	int getNControls() const {
 	  return 2;
 	}
@@ -56,7 +55,7 @@ class MertonParams: public BellmanParams {
 	
     DoublePyArray m_StateGrid;				// grid over wealth
 	PyArrayObject const *m_pStateGrid;	
-	double m_wealth;						// state variable: wealth
+	Grid1D m_StateGridLookup;
     DoublePyArray m_PrevIteration;			// store the previous iteration of the value function
 	PyArrayObject const *m_pPrevIterationArray;	
 	ddFnObj m_uFn;							// utility function for consumption
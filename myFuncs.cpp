@@ -84,8 +84,9 @@ double calculateEV_grid2(PyArrayObject const *pFGrid, PyArrayObject const *pFVal
   DoubleVector x(pdfGrid.size());
   DoubleVector::iterator xi;
   Range::const_iterator iter1, iter2;
+  Grid1D fLookup(pFGrid);
   for (iter1=pdfGrid.begin(), iter2=pdfVals.begin(), xi=x.begin(); iter1 != pdfGrid.end(); iter1++, iter2++, xi++) {
-    (*xi) = (*iter2) * interp1d_grid(pFGrid, pFVals, inverseFn(*iter1));
+    (*xi) = (*iter2) * interp1d_grid(fLookup, pFVals, inverseFn(*iter1));
   }
   double result = trapezoid_integrate(x.begin(), x.end(), pdfGrid.begin());
   return result;
@@ -155,9 +156,14 @@ BOOST_PYTHON_MODULE(_myfuncs)
 
   bpl::class_<PyInterp1D>("Interp1D", bpl::init<DoublePyArray, DoublePyArray>())
 		.def("__call__", &PyInterp1D::interp)  
-		.def("__call__", &PyInterp1D::interp_vector<DoublePyArray::const_iterator, DoublePyArray>)
+		.def("__call__", &PyInterp1D::interp_array)
 		.def("applySorted", &PyInterp1D::apply_sum_sorted_seq<DoublePyArray>)
 	;  
+  bpl::class_<InterpView, boost::noncopyable>("InterpView", bpl::init<DoublePyArray, DoublePyArray>())
+		.def("__call__", &InterpView::interp)  
+		.def("__call__", &InterpView::interp_array)
+		.def("applySorted", &InterpView::apply_sum_sorted_seq<DoublePyArray>)
+	;
   bpl::class_<PyInterp2D>("Interp2D", bpl::init<DoublePyArray, DoublePyArray, DoublePyMatrix>())
 		.def("__call__", &PyInterp2D::interp_tuple)  
 		.def("__call__", &PyInterp2D::interp_list)
@@ -20,18 +20,22 @@
 #include <math.h>
 #include <stdarg.h>
 #include <float.h>
+#include <limits.h>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <memory>
+#include <mutex>
 
 #include <boost/math/distributions/normal.hpp>
 #include <boost/math/distributions/lognormal.hpp>
 #include <boost/math/special_functions/fpclassify.hpp>
-#include <boost/numeric/ublas/matrix.hpp>
-#include <boost/numeric/ublas/matrix_proxy.hpp>
 #include <boost/python.hpp>
 
 #include <pyublas/numpy.hpp>
 #include "myTypes.h"
+#include "simd.h"
 
 using boost::math::isnan;
 namespace bpl = boost::python;
@@ -39,20 +43,454 @@ namespace bpl = boost::python;
 double DLLEXPORT calculateEV_grid(PyArrayObject const *pGrid, PyArrayObject const *pFArray, ddFnObj cdfFn, ddFnObj pdfFn, ddFnObj inverseFn, double leftK, double rightK);
 double DLLEXPORT calculateEV_montecarlo_1d(ddFnObj fFn, DoubleVector const &draws);
 
+// an evenly spaced grid x0, x0+dx, ..., x0+(n-1)*dx.
+// caches 1/dx, so finding a point's cell is a multiply instead of a divide, and clamps with min/max instead of branches.
+// build one when the grid is set, not in the inner loop.
+// the cell weight is (x - x0)/dx - i, computed with the cached 1/dx, where the old interp1d() computed
+// (x - grid[i]) / (grid[i+1] - grid[i]) from the stored points; results can differ from the old code in the last few bits
+class UniformGrid {
+public:
+  double m_x0, m_dx, m_InvDx;
+  int m_n;
+  
+  UniformGrid() : m_x0(0.0), m_dx(1.0), m_InvDx(1.0), m_n(0) {}
+  UniformGrid(double x0, double dx, int n) : m_x0(x0), m_dx(dx), m_InvDx(1.0/dx), m_n(n) {
+    if (n < 2) throw std::logic_error("size must be at least 2");
+  }
+  // spacing is taken from the first two points, as the grid functions below have always done
+  explicit UniformGrid(PyArrayObject const *pGrid) : m_n(ARRAYLEN1D(pGrid)) {
+    if (m_n < 2) throw std::logic_error("size must be at least 2");
+    m_x0 = *ARRAYPTR1D(pGrid, 0);
+	m_dx = *ARRAYPTR1D(pGrid, 1) - m_x0;
+	m_InvDx = 1.0 / m_dx;
+  }
+  template <class Array1D>
+  static UniformGrid fromArray(Array1D const &grid) {
+    if (grid.size() < 2) throw std::logic_error("size must be at least 2");
+    return UniformGrid(grid[0], grid[1] - grid[0], grid.size());
+  }
+  
+  double at(int i) const {
+    return m_x0 + i * m_dx;
+  }
+  double front() const {
+    return m_x0;
+  }
+  double back() const {
+    return at(m_n - 1);
+  }
+  // x forced into [front, back]
+  double clamp(double x) const {
+    return std::min(back(), std::max(front(), x));
+  }
+  // index of the cell [x_i, x_i+1] containing x, in [0, n-2].  points outside the grid go to the first or last cell.
+  // a NaN goes to cell 0
+  int cellIndex(double x) const {
+    double t = std::min(double(m_n - 2), std::max(0.0, (x - m_x0) * m_InvDx));
+	return int(t);
+  }
+  // cell of x after clamping it to the grid, and the linear interpolation weight of the cell's right endpoint, in [0, 1]
+  int cellWeight(double x, double &rWeight) const {
+    double t = std::min(double(m_n - 1), std::max(0.0, (x - m_x0) * m_InvDx));
+	int cell = std::min(int(t), m_n - 2);
+	rWeight = t - cell;
+	return cell;
+  }
+};
+
+// a grid that can be evenly spaced or not.  the grid type is detected when it's built: evenly spaced grids use the
+// UniformGrid fast path.  otherwise, a secondary index table splits [front, back] into equal-width buckets and stores
+// the cell at the start of each one; a lookup is a multiply to find the bucket, then a short scan.
+// buckets are made no wider than the smallest cell (up to BUCKETS_PER_CELL buckets per cell), so the scan is usually 0 or 1 steps
+class Grid1D {
+public:
+  static const int BUCKETS_PER_CELL = 8;
+  bool m_bUniform;
+  UniformGrid m_Uniform;				// the grid itself if it's uniform, otherwise the bucket boundaries
+  DoubleVector m_Points;				// the rest are only used for non-uniform grids
+  DoubleVector m_InvDx;					// 1 / width of each cell
+  std::vector<int> m_BucketCell;		// cell containing the start of each bucket
+  int m_n;
+  
+  Grid1D() : m_bUniform(true), m_n(0) {}
+  explicit Grid1D(DoubleVector const &grid) {
+    init(grid.size(), [&] (int i) -> double { return grid[i]; });
+  }
+  explicit Grid1D(DoublePyArray const &grid) {
+    init(grid.size(), [&] (int i) -> double { return grid[i]; });
+  }
+  explicit Grid1D(PyArrayObject const *pGrid) {
+    init(ARRAYLEN1D(pGrid), [=] (int i) -> double { return *ARRAYPTR1D(pGrid, i); });
+  }
+  
+  template <class GetFn>
+  void init(int n, GetFn get) {
+    if (n < 2) throw std::logic_error("size must be at least 2");
+	m_n = n;
+	double x0 = get(0), xLast = get(n-1), dx = get(1) - x0;
+	// checked here too, so a constant or decreasing grid can't take the uniform path
+	if (!(dx > 0.0)) throw std::logic_error("grid must be strictly increasing");
+	// uniform if every point is within rounding error of x0 + i*dx
+	double tol = 1e-9 * fabs(xLast - x0);
+	m_bUniform = true;
+	for (int i=2; i<n && m_bUniform; i++) {
+	  m_bUniform = (fabs(get(i) - (x0 + i*dx)) <= tol);
+	}
+	if (m_bUniform) {
+	  m_Uniform = UniformGrid(x0, dx, n);
+	  m_Points.clear();
+	  m_InvDx.clear();
+	  m_BucketCell.clear();
+	  return;
+	}
+	m_Points.resize(n);
+	m_InvDx.resize(n-1);
+	for (int i=0; i<n; i++) {
+	  m_Points[i] = get(i);
+	}
+	double minDx = DBL_MAX;
+	for (int i=0; i<n-1; i++) {
+	  double cellDx = m_Points[i+1] - m_Points[i];
+	  if (!(cellDx > 0.0)) throw std::logic_error("grid must be strictly increasing");
+	  m_InvDx[i] = 1.0 / cellDx;
+	  minDx = std::min(minDx, cellDx);
+	}
+	int nBuckets = (int) std::min(double(BUCKETS_PER_CELL * (n-1)), ceil((xLast - x0) / minDx));
+	nBuckets = std::max(nBuckets, 1);
+	m_Uniform = UniformGrid(x0, (xLast - x0) / nBuckets, nBuckets + 1);
+	m_BucketCell.resize(nBuckets);
+	int cell = 0;
+	for (int k=0; k<nBuckets; k++) {
+	  double bucketStart = m_Uniform.at(k);
+	  while (cell < n-2 && m_Points[cell+1] <= bucketStart) {
+	    cell++;
+	  }
+	  m_BucketCell[k] = cell;
+	}
+  }
+  
+  int size() const {
+    return m_n;
+  }
+  double at(int i) const {
+    return m_bUniform ? m_Uniform.at(i) : m_Points[i];
+  }
+  double front() const {
+    return at(0);
+  }
+  double back() const {
+    return at(m_n - 1);
+  }
+  // cell of x after clamping it to the grid, and the linear interpolation weight of the cell's right endpoint, in [0, 1]
+  int cellWeight(double x, double &rWeight) const {
+    if (m_bUniform) {
+	  return m_Uniform.cellWeight(x, rWeight);
+	}
+	double xc = std::min(m_Points.back(), std::max(m_Points.front(), x));
+	int cell = m_BucketCell[m_Uniform.cellIndex(xc)];
+	// the bucket boundaries are rounded, so the scan can go either way
+	while (cell < m_n-2 && xc >= m_Points[cell+1]) {
+	  cell++;
+	}
+	while (cell > 0 && xc < m_Points[cell]) {
+	  cell--;
+	}
+	rWeight = (xc - m_Points[cell]) * m_InvDx[cell];
+	return cell;
+  }
+  // index of the cell [x_i, x_i+1] containing x, in [0, n-2]
+  int cellIndex(double x) const {
+    double w;
+	return cellWeight(x, w);
+  }
+  // cellWeight() at n points
+  void cellWeight_batch(double const *xs, size_t n, int *cells, double *weights) const;
+};
+
+// cell lookup directly on a 1d array of grid points, evenly spaced or not, by bisection.  nothing is allocated or
+// precomputed, so it's what the PyArrayObject versions of the grid functions use; code that does many lookups
+// on the same grid should build a Grid1D once instead
+class ArrayGrid {
+public:
+  PyArrayObject const *m_pGrid;
+  int m_n;
+
+  explicit ArrayGrid(PyArrayObject const *pGrid) : m_pGrid(pGrid), m_n(ARRAYLEN1D(pGrid)) {
+    if (m_n < 2) throw std::logic_error("size must be at least 2");
+  }
+  int size() const {
+    return m_n;
+  }
+  double at(int i) const {
+    return *ARRAYPTR1D(m_pGrid, i);
+  }
+  // same as Grid1D::cellWeight
+  int cellWeight(double x, double &rWeight) const {
+    double xc = std::min(at(m_n-1), std::max(at(0), x));
+	int lo = 0, hi = m_n - 2;
+	// find the last cell whose left endpoint is <= xc
+	while (lo < hi) {
+	  int mid = (lo + hi + 1) / 2;
+	  if (at(mid) <= xc) {
+	    lo = mid;
+	  } else {
+	    hi = mid - 1;
+	  }
+	}
+	double x1 = at(lo);
+	rWeight = (xc - x1) * (1.0 / (at(lo+1) - x1));
+	return lo;
+  }
+  int cellIndex(double x) const {
+    double w;
+	return cellWeight(x, w);
+  }
+};
+
+// batched cell lookup and interpolation, for integrating over many shocks at once.  the AVX2 kernels do 4 points at a
+// time, with gathers for the table lookups, and are used if the CPU has AVX2.  they do the same arithmetic in the same
+// order as the scalar code, so the results are identical
+const size_t INTERP_BATCH_POINTS = 256;		// stack buffer size, in points
+
+inline bool useInterpAVX2() {
+  static const bool bAVX2 = cpuHasAVX2();
+  return bAVX2;
+}
+
+inline void lerpGather_scalar(double const *pF, int const *cells, double const *weights, size_t n, double *out) {
+  for (size_t i=0; i<n; i++) {
+    double f1 = pF[cells[i]];
+	double f2 = pF[cells[i] + 1];
+	out[i] = f1 + weights[i] * (f2 - f1);
+  }
+}
+// pF is row-major with rows of length stride; interpolates along the row first, then between rows
+inline void bilerpGather_scalar(double const *pF, int stride, int const *cells1, double const *weights1,
+                                int const *cells2, double const *weights2, size_t n, double *out) {
+  for (size_t i=0; i<n; i++) {
+    double const *p = pF + cells1[i]*stride + cells2[i];
+	double w2 = weights2[i];
+	double i1 = p[0] + w2 * (p[1] - p[0]);
+	double i2 = p[stride] + w2 * (p[stride+1] - p[stride]);
+	out[i] = i1 + weights1[i] * (i2 - i1);
+  }
+}
+
+// same as bilerpGather, on values stored cell by cell as Interp2D does: pCells holds 4 doubles per cell,
+// f00, f01 - f00, f10, f11 - f10, with nCells2 cells per row
+inline void bilerpCells_scalar(double const *pCells, int nCells2, int const *cells1, double const *weights1,
+                               int const *cells2, double const *weights2, size_t n, double *out) {
+  for (size_t i=0; i<n; i++) {
+    double const *p = pCells + (cells1[i]*nCells2 + cells2[i]) * 4;
+	double w2 = weights2[i];
+	double i1 = p[0] + w2 * p[1];
+	double i2 = p[2] + w2 * p[3];
+	out[i] = i1 + weights1[i] * (i2 - i1);
+  }
+}
+
+#ifdef SIMD_X86
+// the low 32 bits of each lane of a compare result, as 4 ints
+TARGET_AVX2 inline __m128i maskToEpi32(__m256d mask) {
+  __m256i m = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(mask), _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+  return _mm256_castsi256_si128(m);
+}
+
+// _mm256_max_pd(t, lo) is (t > lo) ? t : lo and _mm256_min_pd(t, hi) is (t < hi) ? t : hi, same as std::max(lo, t)
+// and std::min(hi, t), NaN included
+TARGET_AVX2 inline void uniformCellWeight_avx2(UniformGrid const &grid, double const *xs, size_t n, int *cells, double *weights) {
+  __m256d x0 = _mm256_set1_pd(grid.m_x0);
+  __m256d invDx = _mm256_set1_pd(grid.m_InvDx);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d tMax = _mm256_set1_pd(double(grid.m_n - 1));
+  __m128i cellMax = _mm_set1_epi32(grid.m_n - 2);
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m256d t = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(xs + i), x0), invDx);
+	t = _mm256_min_pd(_mm256_max_pd(t, zero), tMax);
+	__m128i cell = _mm_min_epi32(_mm256_cvttpd_epi32(t), cellMax);
+	_mm_storeu_si128((__m128i*) (cells + i), cell);
+	_mm256_storeu_pd(weights + i, _mm256_sub_pd(t, _mm256_cvtepi32_pd(cell)));
+  }
+  for (; i<n; i++) {
+    cells[i] = grid.cellWeight(xs[i], weights[i]);
+  }
+}
+
+// non-uniform grid: gather the bucket's starting cell, then step all 4 lanes until none of them moves
+TARGET_AVX2 inline void grid1DCellWeight_avx2(Grid1D const &grid, double const *xs, size_t n, int *cells, double *weights) {
+  double const *pPoints = &grid.m_Points[0];
+  double const *pInvDx = &grid.m_InvDx[0];
+  int const *pBucketCell = &grid.m_BucketCell[0];
+  UniformGrid const &buckets = grid.m_Uniform;
+  __m256d front = _mm256_set1_pd(grid.m_Points.front());
+  __m256d back = _mm256_set1_pd(grid.m_Points.back());
+  __m256d b0 = _mm256_set1_pd(buckets.m_x0);
+  __m256d bInvDx = _mm256_set1_pd(buckets.m_InvDx);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d bMax = _mm256_set1_pd(double(buckets.m_n - 2));
+  __m128i lastCell = _mm_set1_epi32(grid.m_n - 2);
+  __m128i zeroi = _mm_setzero_si128();
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m256d xc = _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(xs + i), front), back);
+	__m256d t = _mm256_mul_pd(_mm256_sub_pd(xc, b0), bInvDx);
+	__m128i bucket = _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_max_pd(t, zero), bMax));
+	__m128i cell = _mm_i32gather_epi32(pBucketCell, bucket, 4);
+	for (;;) {
+	  __m256d next = _mm256_i32gather_pd(pPoints + 1, cell, 8);
+	  __m128i step = _mm_and_si128(_mm_cmplt_epi32(cell, lastCell), maskToEpi32(_mm256_cmp_pd(xc, next, _CMP_GE_OQ)));
+	  if (_mm_testz_si128(step, step)) break;
+	  cell = _mm_sub_epi32(cell, step);
+	}
+	for (;;) {
+	  __m256d left = _mm256_i32gather_pd(pPoints, cell, 8);
+	  __m128i step = _mm_and_si128(_mm_cmpgt_epi32(cell, zeroi), maskToEpi32(_mm256_cmp_pd(xc, left, _CMP_LT_OQ)));
+	  if (_mm_testz_si128(step, step)) break;
+	  cell = _mm_add_epi32(cell, step);
+	}
+	__m256d left = _mm256_i32gather_pd(pPoints, cell, 8);
+	__m256d invDx = _mm256_i32gather_pd(pInvDx, cell, 8);
+	_mm_storeu_si128((__m128i*) (cells + i), cell);
+	_mm256_storeu_pd(weights + i, _mm256_mul_pd(_mm256_sub_pd(xc, left), invDx));
+  }
+  for (; i<n; i++) {
+    cells[i] = grid.cellWeight(xs[i], weights[i]);
+  }
+}
+
+TARGET_AVX2 inline void lerpGather_avx2(double const *pF, int const *cells, double const *weights, size_t n, double *out) {
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m128i cell = _mm_loadu_si128((__m128i const*) (cells + i));
+	__m256d f1 = _mm256_i32gather_pd(pF, cell, 8);
+	__m256d f2 = _mm256_i32gather_pd(pF + 1, cell, 8);
+	__m256d w = _mm256_loadu_pd(weights + i);
+	_mm256_storeu_pd(out + i, _mm256_add_pd(f1, _mm256_mul_pd(w, _mm256_sub_pd(f2, f1))));
+  }
+  lerpGather_scalar(pF, cells + i, weights + i, n - i, out + i);
+}
+
+TARGET_AVX2 inline void bilerpGather_avx2(double const *pF, int stride, int const *cells1, double const *weights1,
+                                          int const *cells2, double const *weights2, size_t n, double *out) {
+  __m128i strideV = _mm_set1_epi32(stride);
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m128i c1 = _mm_loadu_si128((__m128i const*) (cells1 + i));
+	__m128i c2 = _mm_loadu_si128((__m128i const*) (cells2 + i));
+	__m128i index = _mm_add_epi32(_mm_mullo_epi32(c1, strideV), c2);
+	__m256d f00 = _mm256_i32gather_pd(pF, index, 8);
+	__m256d f01 = _mm256_i32gather_pd(pF + 1, index, 8);
+	__m256d f10 = _mm256_i32gather_pd(pF + stride, index, 8);
+	__m256d f11 = _mm256_i32gather_pd(pF + stride + 1, index, 8);
+	__m256d w1 = _mm256_loadu_pd(weights1 + i);
+	__m256d w2 = _mm256_loadu_pd(weights2 + i);
+	__m256d i1 = _mm256_add_pd(f00, _mm256_mul_pd(w2, _mm256_sub_pd(f01, f00)));
+	__m256d i2 = _mm256_add_pd(f10, _mm256_mul_pd(w2, _mm256_sub_pd(f11, f10)));
+	_mm256_storeu_pd(out + i, _mm256_add_pd(i1, _mm256_mul_pd(w1, _mm256_sub_pd(i2, i1))));
+  }
+  bilerpGather_scalar(pF, stride, cells1 + i, weights1 + i, cells2 + i, weights2 + i, n - i, out + i);
+}
+
+TARGET_AVX2 inline void bilerpCells_avx2(double const *pCells, int nCells2, int const *cells1, double const *weights1,
+                                         int const *cells2, double const *weights2, size_t n, double *out) {
+  __m128i nCells2V = _mm_set1_epi32(nCells2);
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m128i c1 = _mm_loadu_si128((__m128i const*) (cells1 + i));
+	__m128i c2 = _mm_loadu_si128((__m128i const*) (cells2 + i));
+	__m128i index = _mm_slli_epi32(_mm_add_epi32(_mm_mullo_epi32(c1, nCells2V), c2), 2);
+	__m256d f00 = _mm256_i32gather_pd(pCells, index, 8);
+	__m256d d0 = _mm256_i32gather_pd(pCells + 1, index, 8);
+	__m256d f10 = _mm256_i32gather_pd(pCells + 2, index, 8);
+	__m256d d1 = _mm256_i32gather_pd(pCells + 3, index, 8);
+	__m256d w1 = _mm256_loadu_pd(weights1 + i);
+	__m256d w2 = _mm256_loadu_pd(weights2 + i);
+	__m256d i1 = _mm256_add_pd(f00, _mm256_mul_pd(w2, d0));
+	__m256d i2 = _mm256_add_pd(f10, _mm256_mul_pd(w2, d1));
+	_mm256_storeu_pd(out + i, _mm256_add_pd(i1, _mm256_mul_pd(w1, _mm256_sub_pd(i2, i1))));
+  }
+  bilerpCells_scalar(pCells, nCells2, cells1 + i, weights1 + i, cells2 + i, weights2 + i, n - i, out + i);
+}
+#endif //SIMD_X86
+
+inline void Grid1D::cellWeight_batch(double const *xs, size_t n, int *cells, double *weights) const {
+#ifdef SIMD_X86
+  if (useInterpAVX2()) {
+    if (m_bUniform) {
+	  uniformCellWeight_avx2(m_Uniform, xs, n, cells, weights);
+	} else {
+	  grid1DCellWeight_avx2(*this, xs, n, cells, weights);
+	}
+	return;
+  }
+#endif
+  for (size_t i=0; i<n; i++) {
+    cells[i] = cellWeight(xs[i], weights[i]);
+  }
+}
+
+inline void lerpGather(double const *pF, int const *cells, double const *weights, size_t n, double *out) {
+#ifdef SIMD_X86
+  if (useInterpAVX2()) {
+    lerpGather_avx2(pF, cells, weights, n, out);
+	return;
+  }
+#endif
+  lerpGather_scalar(pF, cells, weights, n, out);
+}
+inline void bilerpGather(double const *pF, int stride, int const *cells1, double const *weights1,
+                         int const *cells2, double const *weights2, size_t n, double *out) {
+#ifdef SIMD_X86
+  if (useInterpAVX2()) {
+    bilerpGather_avx2(pF, stride, cells1, weights1, cells2, weights2, n, out);
+	return;
+  }
+#endif
+  bilerpGather_scalar(pF, stride, cells1, weights1, cells2, weights2, n, out);
+}
+
+inline void bilerpCells(double const *pCells, int nCells2, int const *cells1, double const *weights1,
+                        int const *cells2, double const *weights2, size_t n, double *out) {
+#ifdef SIMD_X86
+  if (useInterpAVX2()) {
+    bilerpCells_avx2(pCells, nCells2, cells1, weights1, cells2, weights2, n, out);
+	return;
+  }
+#endif
+  bilerpCells_scalar(pCells, nCells2, cells1, weights1, cells2, weights2, n, out);
+}
+
+// linear interpolation at n points of the values pF, one per grid point.  same as calling interp1d_grid at each point
+inline void interp1d_grid_batch(Grid1D const &grid, double const *pF, double const *xs, size_t n, double *out) {
+  int cells[INTERP_BATCH_POINTS];
+  double weights[INTERP_BATCH_POINTS];
+  for (size_t i=0; i<n; i+=INTERP_BATCH_POINTS) {
+    size_t m = std::min(INTERP_BATCH_POINTS, n - i);
+	grid.cellWeight_batch(xs + i, m, cells, weights);
+	lerpGather(pF, cells, weights, m, out + i);
+  }
+}
+// bilinear interpolation at the n points (xs[i], ys[i]) of the values pF, a row-major grid1.size() x grid2.size() array
+inline void interp2d_grid_batch(Grid1D const &grid1, Grid1D const &grid2, double const *pF, double const *xs, double const *ys, size_t n, double *out) {
+  // the gathers use 32-bit offsets
+  if (double(grid1.size()) * grid2.size() >= double(INT_MAX)) throw std::length_error("interp2d_grid_batch: array too large");
+  int cells1[INTERP_BATCH_POINTS], cells2[INTERP_BATCH_POINTS];
+  double weights1[INTERP_BATCH_POINTS], weights2[INTERP_BATCH_POINTS];
+  for (size_t i=0; i<n; i+=INTERP_BATCH_POINTS) {
+    size_t m = std::min(INTERP_BATCH_POINTS, n - i);
+	grid1.cellWeight_batch(xs + i, m, cells1, weights1);
+	grid2.cellWeight_batch(ys + i, m, cells2, weights2);
+	bilerpGather(pF, grid2.size(), cells1, weights1, cells2, weights2, m, out + i);
+  }
+}
+
 // grid utility functions
  int getCellIndex(double value, PyArrayObject const *pGrid) {
-  double dx = *ARRAYPTR1D(pGrid, 1) - *ARRAYPTR1D(pGrid, 0);
   if (value < *ARRAYPTR1D(pGrid, 0)) {
     return -1;
-  } else if (value >= *ARRAYPTR1D(pGrid, ARRAYLEN1D(pGrid)-1)) {
-    return ARRAYLEN1D(pGrid) - 2;
-  } else {
-    int result = (int) floor((value - *ARRAYPTR1D(pGrid, 0)) / dx);
-	if (result == (ARRAYLEN1D(pGrid) - 1)) {
-	  result--;
-	}
-	return result;
   }
+  return ArrayGrid(pGrid).cellIndex(value);
 }
  int getCellIndex_wrap(double value, DoublePyArray const &grid) {
   PyArrayObject const *pGrid = (PyArrayObject const*) grid.data().handle().get();
@@ -88,17 +526,17 @@ double DLLEXPORT calculateEV_montecarlo_1d(ddFnObj fFn, DoubleVector const &draw
   return result;
 }
 
+// linear interpolation of F on a UniformGrid, Grid1D or ArrayGrid.  points outside the grid get the value at the boundary
+template <class GridT>
+inline double interp1d_grid(GridT const &grid, PyArrayObject const *pF, double xi) {
+  double w;
+  int i = grid.cellWeight(xi, w);
+  double f1 = *ARRAYPTR1D(pF, i);
+  double f2 = *ARRAYPTR1D(pF, i+1);
+  return f1 + w * (f2 - f1);
+}
  double interp1d_grid(PyArrayObject const *pGrid, PyArrayObject const *pF, double xi) {
-  double a, x1, x2, f1, f2, result;
-  int i;
-  a = forceToGrid(xi, pGrid);
-  i = getCellIndex(a, pGrid);
-  x1 = *ARRAYPTR1D(pGrid, i);
-  x2 = *ARRAYPTR1D(pGrid, i+1);
-  f1 = *ARRAYPTR1D(pF, i);
-  f2 = *ARRAYPTR1D(pF, i+1);
-  result = interp1d(xi, x1, f1, x2, f2);
-  return result;
+  return interp1d_grid(ArrayGrid(pGrid), pF, xi);
 }
  double interp1d_grid_wrap(DoublePyArray const &grid1, DoublePyArray const &F, double xi) {
   PyArrayObject const *pGrid1 = (PyArrayObject const*) grid1.data().handle().get();
@@ -106,10 +544,45 @@ double DLLEXPORT calculateEV_montecarlo_1d(ddFnObj fFn, DoubleVector const &draw
   return interp1d_grid(pGrid1, pF, xi);
 }
 
+// sum of the linear interpolation of vals over grid at a sequence of points sorted in ascending order, with slope[i] the
+// slope on cell i.  the points in each cell are summed first, so a cell costs one multiply.  used for monte carlo integration.
+// points outside the grid get the value at the boundary
+template <typename Iter1>
+double lininterp_sum_sorted(double const *grid, double const *vals, double const *slope, size_t n, Iter1 begin, Iter1 end) {
+  double sum = 0.0, incr, cell_x_sum;
+  Iter1 i=begin;
+  size_t currentCell = 0;
+  int count = 0;
+  while (i != end && *i < grid[0]) {	// skip over points below grid
+    count++;
+	i++;
+  }
+  sum += vals[0] * (double) count;	
+  while (currentCell < n-1 && i != end) {
+    cell_x_sum = 0.0;
+	count = 0;
+	while (i != end && *i < grid[currentCell+1]) {	
+	  cell_x_sum += *i;
+	  count++;
+	  i++;
+	}
+	incr = vals[currentCell]*count + (cell_x_sum - grid[currentCell]*count) * slope[currentCell];
+	sum += incr;
+	currentCell++;
+  }
+  count = 0;
+  while (i != end) {
+    count++;
+	i++;
+  }
+  sum += vals[n-1] * (double) count;	
+  return sum;
+}
+
 class Interp1D {
 public:
   DoubleVector m_grid, m_vals, m_slope;
-  double m_dx;
+  Grid1D m_Lookup;
 
   template<class Array1D_T1, class Array1D_T2>
   Interp1D(Array1D_T1 const &gridArray, Array1D_T2 const &valsArray) {
@@ -123,29 +596,29 @@ public:
 	for (unsigned int i=0; i<gridArray.size()-1; i++) {
 	  m_slope[i] = (m_vals[i+1] - m_vals[i]) / (m_grid[i+1] - m_grid[i]);
 	}
-	m_dx = m_grid[1] - m_grid[0];
+	m_Lookup = Grid1D(m_grid);
   }
   
+  // points outside the grid get the value at the boundary
   double interp(double xi) const {
-    // check if outside grid
-	if (xi < m_grid.front()) {
-	  return m_vals.front();
-	}
-	if (xi > m_grid.back()) {
-	  return m_vals.back();
-	}
-	// get cell
-    int cell = (int) floor((xi - m_grid.front()) / m_dx);	
-	if (cell == m_grid.size()-1) {
-	  cell--;
-	}
-    // interp
-    double result = m_vals[cell] + (xi - m_grid[cell]) * m_slope[cell];
+    double w;
+	int cell = m_Lookup.cellWeight(xi, w);
+    double result = m_vals[cell] + w * (m_vals[cell+1] - m_vals[cell]);
 	return result;
   }
   double operator() (double xi) {
     return interp(xi);
   }  
+  void interp_batch(double const *xs, size_t n, double *out) const {
+    interp1d_grid_batch(m_Lookup, &m_vals[0], xs, n, out);
+  }
+  DoublePyArray interp_array(DoublePyArray const &xs) const {
+    DoublePyArray result(xs.size());
+	if (xs.size() > 0) {
+	  interp_batch(&xs[0], xs.size(), &result[0]);
+	}
+	return result;
+  }
   template <typename Iter1, typename ResultT>
   ResultT interp_vector(Iter1 xBegin, Iter1 xEnd) const {
     ResultT result(xEnd-xBegin);
@@ -159,97 +632,154 @@ public:
   }
   template <typename Iter1>
   double apply_sum_sorted(Iter1 begin, Iter1 end) const {
-    double sum = 0.0, incr, cell_x_sum;
-	Iter1 i=begin;
-	unsigned int currentCell = 0;
-	int count = 0;
-	while (*i < m_grid.front() && i != end) {	// skip over points below grid
-	  count++;
-	  i++;
-	}
-	sum += m_vals.front() * (double) count;	
-	while (currentCell < m_grid.size()-1 && i != end) {
-	  cell_x_sum = 0.0;
-	  count = 0;
-	  while (*i < m_grid[currentCell+1] && i != end) {	
-	    //incr = m_vals[currentCell] + (*i - m_grid[currentCell]) * m_slope[currentCell];
-		cell_x_sum += *i;
-		count++;
-		//sum += incr;		
-	    i++;
-	  }
-	  incr = m_vals[currentCell]*count + (cell_x_sum - m_grid[currentCell]*count) * m_slope[currentCell];
-	  sum += incr;
-	  currentCell++;
-	}
-	count = 0;
-	while (i != end) {
-	  count++;
-	  i++;
-	}
-	sum += m_vals.back() * (double) count;	
-	return sum;
+    return lininterp_sum_sorted(&m_grid[0], &m_vals[0], &m_slope[0], m_grid.size(), begin, end);
   }
 };
 
 typedef Interp1D PyInterp1D;
 
+// linear interpolation over numpy arrays, without copying them.  holding the DoublePyArrays keeps the buffers alive,
+// so the caller must not modify them while the view is in use.  the grid lookup can be shared between views over the
+// same grid, e.g. one per value function iteration.  the slopes are only needed by apply_sum_sorted, so they are
+// computed the first time it's called
+class InterpView {
+public:
+  DoublePyArray m_Grid, m_Vals;
+  std::shared_ptr<Grid1D const> m_pLookup;
+  
+  InterpView(DoublePyArray const &grid, DoublePyArray const &vals)
+  : m_Grid(grid), m_Vals(vals), m_pLookup(new Grid1D(grid)) {
+    init();
+  }
+  InterpView(std::shared_ptr<Grid1D const> const &pLookup, DoublePyArray const &grid, DoublePyArray const &vals)
+  : m_Grid(grid), m_Vals(vals), m_pLookup(pLookup) {
+    init();
+  }
+  
+  double interp(double xi) const {
+    double w;
+	int cell = m_pLookup->cellWeight(xi, w);
+	return m_pVals[cell] + w * (m_pVals[cell+1] - m_pVals[cell]);
+  }
+  double operator() (double xi) const {
+    return interp(xi);
+  }
+  void interp_batch(double const *xs, size_t n, double *out) const {
+    interp1d_grid_batch(*m_pLookup, m_pVals, xs, n, out);
+  }
+  DoublePyArray interp_array(DoublePyArray const &xs) const {
+    DoublePyArray result(xs.size());
+	if (xs.size() > 0) {
+	  interp_batch(&xs[0], xs.size(), &result[0]);
+	}
+	return result;
+  }
+  template <typename Iter1>
+  double apply_sum_sorted(Iter1 begin, Iter1 end) const {
+    std::call_once(m_SlopeOnce, [this] () {
+	  m_Slope.resize(m_n - 1);
+	  for (size_t i=0; i<m_n-1; i++) {
+	    m_Slope[i] = (m_pVals[i+1] - m_pVals[i]) / (m_pGrid[i+1] - m_pGrid[i]);
+	  }
+	});
+	return lininterp_sum_sorted(m_pGrid, m_pVals, &m_Slope[0], m_n, begin, end);
+  }
+  template <typename Array1D>
+  double apply_sum_sorted_seq(Array1D const &sorted) const {
+    return apply_sum_sorted(sorted.begin(), sorted.end());    
+  }
+  
+private:
+  InterpView(InterpView const &);
+  InterpView& operator=(InterpView const &);
+  void init() {
+    if (m_Grid.size() != m_Vals.size()) throw std::logic_error("x and y must be the same size");
+	if (m_Grid.size() != (size_t) m_pLookup->size()) throw std::logic_error("grid lookup does not match grid");
+	m_n = m_Grid.size();
+	m_pGrid = &m_Grid[0];
+	m_pVals = &m_Vals[0];
+  }
+  size_t m_n;
+  double const *m_pGrid, *m_pVals;
+  mutable DoubleVector m_Slope;
+  mutable std::once_flag m_SlopeOnce;
+};
+
+// bilinear interpolation on a 2d grid.  the values are kept cell by cell in one cache-line-aligned block: each cell
+// [x1_i, x1_i+1] x [x2_j, x2_j+1] holds 4 doubles (CELL_DOUBLES), f(i,j), f(i,j+1) - f(i,j), f(i+1,j), f(i+1,j+1) - f(i+1,j),
+// so a lookup reads 32 bytes from a single cache line.  this is about 4 times the memory of the values themselves.
+// building it is one pass over the values
 class Interp2D {
 public:
-  DoubleVector m_grid1, m_grid2;
-  typedef boost::numeric::ublas::matrix<double> DoubleMatrix;
-  typedef boost::numeric::ublas::matrix_row<DoubleMatrix> DoubleMatrixRow;
-  DoubleMatrix m_vals;
-  typedef std::shared_ptr<Interp1D> InterpPtr;
-  //typedef Interp1D *InterpPtr;
-  std::vector<InterpPtr> m_Interps;   // we'll keep a size1-length vector of 1d interps, each one interpolates over grid2
-  double m_dx1;
+  static const int CELL_DOUBLES = 4;
+  Grid1D m_Lookup1, m_Lookup2;
+  AlignedDoubleVector m_Cells;
+  int m_nCells2;							// cells along grid2, the stride between cells along grid1
   
   template<class Array1D_T1, class Array1D_T2, class Array2D>
   Interp2D(Array1D_T1 const &grid1, Array1D_T2 const &grid2, Array2D const &vals) {
     if (grid1.size() != vals.size1() || grid2.size() != vals.size2()) throw std::logic_error("grid does not match array size");	
 	if (grid1.size() < 2 || grid2.size() < 2) throw std::logic_error("size must be at least 2");	
-	// copy grids
-	m_grid1.resize(grid1.size());
-	m_grid2.resize(grid2.size());
-	std::copy(grid1.begin(), grid1.end(), m_grid1.begin());
-	std::copy(grid2.begin(), grid2.end(), m_grid2.begin());
-	// copy vals
-	m_vals.resize(grid1.size(), grid2.size());
-	for (int i=0; i<vals.size1(); i++) {
-	  for (int j=0; j<vals.size2(); j++) {
-	    m_vals(i,j) = vals(i,j);
+	m_Lookup1.init(grid1.size(), [&] (int i) -> double { return grid1[i]; });
+	m_Lookup2.init(grid2.size(), [&] (int i) -> double { return grid2[i]; });
+	int n1 = grid1.size(), n2 = grid2.size();
+	// the batch lookups use 32-bit offsets
+	if (double(n1 - 1) * (n2 - 1) * CELL_DOUBLES >= double(INT_MAX)) throw std::length_error("Interp2D: array too large");
+	m_nCells2 = n2 - 1;
+	m_Cells.resize(size_t(n1 - 1) * m_nCells2 * CELL_DOUBLES);
+	double *pCell = &m_Cells[0];
+	for (int i=0; i<n1-1; i++) {
+	  for (int j=0; j<n2-1; j++, pCell += CELL_DOUBLES) {
+	    double f00 = vals(i,j), f01 = vals(i,j+1);
+		double f10 = vals(i+1,j), f11 = vals(i+1,j+1);
+		pCell[0] = f00;
+		pCell[1] = f01 - f00;
+		pCell[2] = f10;
+		pCell[3] = f11 - f10;
 	  }
 	}
-	// construct interp1d vector
-	for (int i=0; i<grid1.size(); i++) {
-	  DoubleMatrixRow row (m_vals, i);
-	  m_Interps.push_back(InterpPtr(new Interp1D(grid2, row)));
-	}
-	m_dx1 = m_grid1[1] - m_grid1[0];
   }
+  // points outside the grid are forced to the boundary
   double interp(double x1, double x2) const {
-    // check if outside grid1
-	if (x1 < m_grid1.front()) {
-	  x1 = m_grid1.front();
-	}
-	if (x1 > m_grid1.back()) {
-	  x1 = m_grid1.back();
-	}
-	// get cell
-    int cell = (int) floor((x1 - m_grid1.front()) / m_dx1);	
-	if (cell == m_grid1.size()-1) {
-	  cell--;
-	}
-    // interp along grid2
-	double i1 = m_Interps[cell]->interp(x2);
-	double i2 = m_Interps[cell+1]->interp(x2);
-	double result = interp1d(x1, m_grid1[cell], i1, m_grid1[cell+1], i2);
+	double w1, w2;
+	int i = m_Lookup1.cellWeight(x1, w1);
+	int j = m_Lookup2.cellWeight(x2, w2);
+	double const *pCell = &m_Cells[(size_t(i) * m_nCells2 + j) * CELL_DOUBLES];
+    // interp along grid2 on both sides of the cell, then along grid1
+	double i1 = pCell[0] + w2 * pCell[1];
+	double i2 = pCell[2] + w2 * pCell[3];
+	double result = i1 + w1 * (i2 - i1);
 	return result;
   }
   double operator() (double x1, double x2) {
     return interp(x1, x2);
   }   
+  // the 4 grid values that interp(x1, x2) is a weighted sum of, as indices into the values in C order, and their weights
+  void cornerWeights(double x1, double x2, size_t offsets[4], double weights[4]) const {
+	double w1, w2;
+	int i = m_Lookup1.cellWeight(x1, w1);
+	int j = m_Lookup2.cellWeight(x2, w2);
+	size_t n2 = m_nCells2 + 1;
+	offsets[0] = size_t(i) * n2 + j;
+	offsets[1] = offsets[0] + 1;
+	offsets[2] = offsets[0] + n2;
+	offsets[3] = offsets[2] + 1;
+	weights[0] = (1.0 - w1) * (1.0 - w2);
+	weights[1] = (1.0 - w1) * w2;
+	weights[2] = w1 * (1.0 - w2);
+	weights[3] = w1 * w2;
+  }
+  // interpolate at the n points (x1s[i], x2s[i])
+  void interp_batch(double const *x1s, double const *x2s, size_t n, double *out) const {
+    int cells1[INTERP_BATCH_POINTS], cells2[INTERP_BATCH_POINTS];
+	double weights1[INTERP_BATCH_POINTS], weights2[INTERP_BATCH_POINTS];
+	for (size_t i=0; i<n; i+=INTERP_BATCH_POINTS) {
+	  size_t m = std::min(INTERP_BATCH_POINTS, n - i);
+	  m_Lookup1.cellWeight_batch(x1s + i, m, cells1, weights1);
+	  m_Lookup2.cellWeight_batch(x2s + i, m, cells2, weights2);
+	  bilerpCells(&m_Cells[0], m_nCells2, cells1, weights1, cells2, weights2, m, out + i);
+	}
+  }
   double interp_tuple (bpl::tuple const &x) {
     double x1 = bpl::extract<double>(x[0]);
 	double x2 = bpl::extract<double>(x[1]);
@@ -264,6 +794,244 @@ public:
 };
 typedef Interp2D PyInterp2D;
 
+// shape-preserving interpolation.  a value function that's monotone or concave between grid points can be interpolated
+// with a smooth spline that keeps its shape, instead of linearly, so the same accuracy needs fewer grid points.
+// INTERP_MONOTONE_CUBIC is a Fritsch-Carlson piecewise cubic Hermite spline, INTERP_SCHUMAKER is Schumaker's
+// shape-preserving quadratic spline (one extra knot per cell where needed, see Judd, Numerical Methods in Economics, 6.11).
+// both only look at nearby grid points, so a cell can be built from 6 values.  the cubic's slopes are limited at the nodes,
+// not cell by cell, so the spline stays C1
+enum InterpKindT {INTERP_LINEAR, INTERP_MONOTONE_CUBIC, INTERP_SCHUMAKER};
+
+// slope estimate at node k, 0 <= k < n, of the points (x(i), f(i)).  only looks at nodes k-2..k+2
+template <class GetX, class GetF>
+double shapeNodeSlope(InterpKindT kind, int n, int k, GetX x, GetF f) {
+  if (n == 2 || kind == INTERP_LINEAR) {
+    int cell = std::min(k, n-2);
+	return (f(cell+1) - f(cell)) / (x(cell+1) - x(cell));
+  }
+  if (k == 0 || k == n-1) {
+    // endpoints: the secant for the cubic, 3/2 secant - 1/2 next slope for schumaker
+    int cell = (k == 0) ? 0 : n-2;
+	double d = (f(cell+1) - f(cell)) / (x(cell+1) - x(cell));
+	if (kind == INTERP_MONOTONE_CUBIC) {
+	  return d;
+	}
+	return (3.0*d - shapeNodeSlope(kind, n, (k == 0) ? 1 : n-2, x, f)) / 2.0;
+  }
+  double hL = x(k) - x(k-1), hR = x(k+1) - x(k);
+  double dfL = f(k) - f(k-1), dfR = f(k+1) - f(k);
+  double dL = dfL / hL, dR = dfR / hR;
+  // a local max or min gets a flat slope
+  if (!(dL * dR > 0.0)) {
+    return 0.0;
+  }
+  if (kind == INTERP_MONOTONE_CUBIC) {
+    return (dL + dR) / 2.0;
+  }
+  double LL = sqrt(hL*hL + dfL*dfL), LR = sqrt(hR*hR + dfR*dfR);
+  return (LL*dL + LR*dR) / (LL + LR);
+}
+
+// Fritsch-Carlson scale factor of a cell with secant d and end slopes s0, s1: 0 for a flat cell, otherwise whatever
+// brings (s0/d, s1/d) into the circle alpha^2 + beta^2 <= 9
+inline double fritschCarlsonScale(double d, double s0, double s1) {
+  if (d == 0.0) {
+    return 0.0;
+  }
+  double alpha = s0 / d, beta = s1 / d;
+  double r2 = alpha*alpha + beta*beta;
+  return (r2 > 9.0) ? 3.0 / sqrt(r2) : 1.0;
+}
+
+// shapeNodeSlope(), limited for the cubic by the smaller scale factor of the two cells next to node k, so both cells
+// stay monotone and share the slope.  only looks at nodes k-2..k+2
+template <class GetX, class GetF>
+double shapeLimitedSlope(InterpKindT kind, int n, int k, GetX x, GetF f) {
+  double slope = shapeNodeSlope(kind, n, k, x, f);
+  if (kind != INTERP_MONOTONE_CUBIC) {
+    return slope;
+  }
+  double tau = 1.0;
+  for (int cell=std::max(k-1, 0); cell<=std::min(k, n-2); cell++) {
+    double d = (f(cell+1) - f(cell)) / (x(cell+1) - x(cell));
+	tau = std::min(tau, fritschCarlsonScale(d, shapeNodeSlope(kind, n, cell, x, f), shapeNodeSlope(kind, n, cell+1, x, f)));
+  }
+  return tau * slope;
+}
+
+// a cell of a shape-preserving spline, in 8 doubles (one cache line): x_i, the knot t*, then the piece left of the knot,
+// c0 + c1*t + c2*t^2 + c3*t^3 with t = x - x_i, then d1, d2 of the piece right of the knot, p(t*) + d1*s + d2*s^2 with s = t - t*.
+// cells with no knot have t* = DBL_MAX
+const int SHAPE_CELL_DOUBLES = 8;
+
+// build the cell [x0, x0+h] with values f0, f1 and end slopes s0, s1, from shapeLimitedSlope()
+inline void buildShapeCell(InterpKindT kind, double x0, double h, double f0, double f1, double s0, double s1, double *rec) {
+  double d = (f1 - f0) / h;
+  std::fill(rec, rec + SHAPE_CELL_DOUBLES, 0.0);
+  rec[0] = x0;
+  rec[1] = DBL_MAX;
+  rec[2] = f0;
+  if (kind == INTERP_LINEAR) {
+    rec[3] = d;
+	return;
+  }
+  if (kind == INTERP_MONOTONE_CUBIC) {
+    // the slopes are already limited
+	rec[3] = s0;
+	rec[4] = (3.0*d - 2.0*s0 - s1) / h;
+	rec[5] = (s0 + s1 - 2.0*d) / (h*h);
+	return;
+  }
+  // schumaker.  if the average of the end slopes is the secant, one quadratic fits
+  if (fabs(s0 + s1 - 2.0*d) <= 1e-12 * (fabs(s0) + fabs(s1) + fabs(d))) {
+    rec[3] = s0;
+	rec[4] = (s1 - s0) / (2.0*h);
+	return;
+  }
+  // otherwise put a knot at xi, where the slope is sBar
+  double xi;
+  if ((s0 - d) * (s1 - d) >= 0.0) {
+    xi = h / 2.0;
+  } else if (fabs(s1 - d) < fabs(s0 - d)) {
+    xi = h * (s1 - d) / (s1 - s0);
+  } else {
+    xi = h + h * (s0 - d) / (s1 - s0);
+  }
+  double alpha = xi, beta = h - xi;
+  double sBar = (2.0*(f1 - f0) - (alpha*s0 + beta*s1)) / h;
+  rec[1] = xi;
+  rec[3] = s0;
+  rec[4] = (alpha > 0.0) ? (sBar - s0) / (2.0*alpha) : 0.0;
+  rec[6] = sBar;
+  rec[7] = (beta > 0.0) ? (s1 - sBar) / (2.0*beta) : 0.0;
+}
+
+inline double evalShapeCell(double const *rec, double x) {
+  double t = x - rec[0];
+  double knot = rec[1];
+  if (t <= knot) {
+    return rec[2] + t*(rec[3] + t*(rec[4] + t*rec[5]));
+  }
+  double fKnot = rec[2] + knot*(rec[3] + knot*rec[4]);
+  double s = t - knot;
+  return fKnot + s*(rec[6] + s*rec[7]);
+}
+
+// build the n-1 cells of the spline through (x(i), f(i)) into pCells
+template <class GetX, class GetF>
+void buildShapeCells(InterpKindT kind, int n, GetX x, GetF f, double *pCells) {
+  DoubleVector slopes(n);
+  for (int k=0; k<n; k++) {
+    slopes[k] = shapeLimitedSlope(kind, n, k, x, f);
+  }
+  for (int i=0; i<n-1; i++) {
+    buildShapeCell(kind, x(i), x(i+1) - x(i), f(i), f(i+1), slopes[i], slopes[i+1], pCells + i*SHAPE_CELL_DOUBLES);
+  }
+}
+
+// 1d shape-preserving spline.  points outside the grid get the value at the boundary
+class Spline1D {
+public:
+  InterpKindT m_Kind;
+  Grid1D m_Lookup;
+  double m_Front, m_Back;
+  AlignedDoubleVector m_Cells;
+  
+  template<class Array1D_T1, class Array1D_T2>
+  Spline1D(Array1D_T1 const &grid, Array1D_T2 const &vals, InterpKindT kind) : m_Kind(kind) {
+    if (grid.size() != vals.size()) throw std::logic_error("x and y must be the same size");	
+	int n = grid.size();
+	m_Lookup.init(n, [&] (int i) -> double { return grid[i]; });
+	m_Front = grid[0];
+	m_Back = grid[n-1];
+	m_Cells.resize(size_t(n-1) * SHAPE_CELL_DOUBLES);
+	buildShapeCells(kind, n, [&] (int i) -> double { return grid[i]; }, [&] (int i) -> double { return vals[i]; }, &m_Cells[0]);
+  }
+  double interp(double xi) const {
+    double xc = std::min(m_Back, std::max(m_Front, xi));
+	int cell = m_Lookup.cellIndex(xc);
+	return evalShapeCell(&m_Cells[cell*SHAPE_CELL_DOUBLES], xc);
+  }
+  double operator() (double xi) const {
+    return interp(xi);
+  }
+  void interp_batch(double const *xs, size_t n, double *out) const {
+    int cells[INTERP_BATCH_POINTS];
+	double weights[INTERP_BATCH_POINTS];
+	for (size_t i0=0; i0<n; i0+=INTERP_BATCH_POINTS) {
+	  size_t m = std::min(INTERP_BATCH_POINTS, n - i0);
+	  m_Lookup.cellWeight_batch(xs + i0, m, cells, weights);
+	  for (size_t i=0; i<m; i++) {
+	    double xc = std::min(m_Back, std::max(m_Front, xs[i0 + i]));
+		out[i0 + i] = evalShapeCell(&m_Cells[cells[i]*SHAPE_CELL_DOUBLES], xc);
+	  }
+	}
+  }
+  DoublePyArray interp_array(DoublePyArray const &xs) const {
+    DoublePyArray result(xs.size());
+	if (xs.size() > 0) {
+	  interp_batch(&xs[0], xs.size(), &result[0]);
+	}
+	return result;
+  }
+};
+
+// tensor product 2d shape-preserving spline: a spline along grid2 for each point of grid1, then at each lookup, a cell
+// along grid1 built from the (up to) 6 rows around x1.  the rows share one lookup on grid2 and their cells are stored
+// in one block, row by row.  points outside the grid are forced to the boundary
+class Spline2D {
+public:
+  InterpKindT m_Kind;
+  Grid1D m_Lookup1, m_Lookup2;
+  DoubleVector m_Grid1;
+  AlignedDoubleVector m_Cells;
+  int m_nCells2;							// cells per row
+  
+  template<class Array1D_T1, class Array1D_T2, class Array2D>
+  Spline2D(Array1D_T1 const &grid1, Array1D_T2 const &grid2, Array2D const &vals, InterpKindT kind) : m_Kind(kind) {
+    if (grid1.size() != vals.size1() || grid2.size() != vals.size2()) throw std::logic_error("grid does not match array size");	
+	int n1 = grid1.size(), n2 = grid2.size();
+	m_Lookup1.init(n1, [&] (int i) -> double { return grid1[i]; });
+	m_Lookup2.init(n2, [&] (int j) -> double { return grid2[j]; });
+	m_Grid1.assign(grid1.begin(), grid1.end());
+	m_nCells2 = n2 - 1;
+	m_Cells.resize(size_t(n1) * m_nCells2 * SHAPE_CELL_DOUBLES);
+	for (int i=0; i<n1; i++) {
+	  buildShapeCells(kind, n2, [&] (int j) -> double { return grid2[j]; }, [&] (int j) -> double { return vals(i,j); },
+	                  &m_Cells[size_t(i) * m_nCells2 * SHAPE_CELL_DOUBLES]);
+	}
+  }
+  double interp(double x1, double x2) const {
+    int n1 = m_Grid1.size();
+    double xc = std::min(m_Grid1.back(), std::max(m_Grid1.front(), x1));
+	int cell = m_Lookup1.cellIndex(xc);
+	double xc2 = std::min(m_Lookup2.back(), std::max(m_Lookup2.front(), x2));
+	int cell2 = m_Lookup2.cellIndex(xc2);
+	// rows cell-2 .. cell+3, the ones the limited slopes at cell and cell+1 depend on
+	int first = std::max(cell-2, 0), last = std::min(cell+3, n1-1);
+	double rowVals[6];
+	for (int k=first; k<=last; k++) {
+	  rowVals[k - first] = evalShapeCell(&m_Cells[(size_t(k) * m_nCells2 + cell2) * SHAPE_CELL_DOUBLES], xc2);
+	}
+	DoubleVector const &grid1 = m_Grid1;
+	auto x = [&] (int i) -> double { return grid1[i]; };
+	auto f = [&] (int i) -> double { return rowVals[i - first]; };
+	double s0 = shapeLimitedSlope(m_Kind, n1, cell, x, f);
+	double s1 = shapeLimitedSlope(m_Kind, n1, cell+1, x, f);
+	double rec[SHAPE_CELL_DOUBLES];
+	buildShapeCell(m_Kind, grid1[cell], grid1[cell+1] - grid1[cell], f(cell), f(cell+1), s0, s1, rec);
+	return evalShapeCell(rec, xc);
+  }
+  double operator() (double x1, double x2) const {
+    return interp(x1, x2);
+  }
+  void interp_batch(double const *x1s, double const *x2s, size_t n, double *out) const {
+    for (size_t i=0; i<n; i++) {
+	  out[i] = interp(x1s[i], x2s[i]);
+	}
+  }
+};
+
 // bilinear interpolation between 4 points of a rectangle, corners (x1,y1), (x2,y2)
 // f_1_1 = f(x1,y1)
  double interp2d(double z1, double z2, double x1, double y1, double x2, double y2, double f_1_1, double f_1_2, double f_2_1, double f_2_2) {  
@@ -275,28 +1043,26 @@ typedef Interp2D PyInterp2D;
   return result;
 }
 
+// bilinear interploation of F on UniformGrids, Grid1Ds or ArrayGrids.  points outside the grid are forced to the boundary
+template <class GridT>
+inline double interp2d_grid(GridT const &grid1, GridT const &grid2, PyArrayObject const *pF, double xi, double yi) {
+  double wx, wy;
+  // figure out which cell xi,yi is in
+  int i = grid1.cellWeight(xi, wx);
+  int j = grid2.cellWeight(yi, wy);
+  // get values of f at corners
+  double u1 = *(double*) PyArray_GETPTR2(pF, i, j);
+  double u2 = *(double*) PyArray_GETPTR2(pF, i+1, j);
+  double u3 = *(double*) PyArray_GETPTR2(pF, i, j+1);
+  double u4 = *(double*) PyArray_GETPTR2(pF, i+1, j+1);
+  // interpolate along grid1, then grid2
+  double f_y1 = u1 + wx * (u2 - u1);
+  double f_y2 = u3 + wx * (u4 - u3);
+  return f_y1 + wy * (f_y2 - f_y1);
+}
 // bilinear interploation of F, given grid points in grid1, grid2
  double interp2d_grid(PyArrayObject const *pGrid1, PyArrayObject const *pGrid2, PyArrayObject const *pF, double xi, double yi) {
-  double a,b;
-  int i,j;
-  double x1,x2,y1,y2,u1,u2,u3,u4;
-  // figure out which cell xi,yi is in
-  a = forceToGrid(xi, pGrid1);
-  b = forceToGrid(yi, pGrid2);
-  i = getCellIndex(a, pGrid1);
-  j = getCellIndex(b, pGrid2);
-  // get values of x,y,f at corners
-  x1 = *(double*) PyArray_GETPTR1(pGrid1, i);
-  x2 = *(double*) PyArray_GETPTR1(pGrid1, i+1);
-  y1 = *(double*) PyArray_GETPTR1(pGrid2, j);
-  y2 = *(double*) PyArray_GETPTR1(pGrid2, j+1);
-  u1 = *(double*) PyArray_GETPTR2(pF, i, j);
-  u2 = *(double*) PyArray_GETPTR2(pF, i+1, j);
-  u3 = *(double*) PyArray_GETPTR2(pF, i, j+1);
-  u4 = *(double*) PyArray_GETPTR2(pF, i+1, j+1);
-  // interpolate
-  double result = interp2d(xi, yi, x1, y1, x2, y2, u1, u3, u2, u4);
-  return result;
+  return interp2d_grid(ArrayGrid(pGrid1), ArrayGrid(pGrid2), pF, xi, yi);
 }
  double interp2d_grid_wrap(DoublePyArray const &grid1, DoublePyArray const &grid2, DoublePyArray const &F, double xi, double yi) {
   PyArrayObject const *pGrid1 = (PyArrayObject const*) grid1.data().handle().get();
@@ -305,51 +1071,39 @@ typedef Interp2D PyInterp2D;
   return interp2d_grid(pGrid1, pGrid2, pF, xi, yi);
 }
   
-// trilinear interpolation
+// trilinear interpolation on UniformGrids, Grid1Ds or ArrayGrids
 // pF is a 3d array of doubles
-// pGrid1-3 are 1d arrays with the grid coords (must be evenly spaced)
-// return interpolated value f(x1, x2, x3)
- double interp3d_grid(PyArrayObject const *pGrid1, PyArrayObject const *pGrid2, PyArrayObject const *pGrid3, PyArrayObject const *pF,
+// return interpolated value f(x1, x2, x3).  points outside the grid are forced to the boundary
+template <class GridT>
+inline double interp3d_grid(GridT const &grid1, GridT const &grid2, GridT const &grid3, PyArrayObject const *pF,
     double xi, double yi, double zi) {
-  double a, b, c;
-  int i, j, k;
-  double x1, x2, y1, y2, z1, z2;
-  double u1, u2, u3, u4, u5, u6, u7, u8;
-  double w1, w2, w3, w4, w5, w6, w7, u;
-
-  a = forceToGrid(xi, pGrid1);
-  b = forceToGrid(yi, pGrid2);
-  c = forceToGrid(zi, pGrid3);
-  i = getCellIndex(a, pGrid1);
-  j = getCellIndex(b, pGrid2);
-  k = getCellIndex(c, pGrid3);
-  
-  x1 = *ARRAYPTR1D(pGrid1, i);
-  x2 = *ARRAYPTR1D(pGrid1, i+1);
-  y1 = *ARRAYPTR1D(pGrid2, j);
-  y2 = *ARRAYPTR1D(pGrid2, j+1);
-  z1 = *ARRAYPTR1D(pGrid3, k);
-  z2 = *ARRAYPTR1D(pGrid3, k+1);
+  double wx, wy, wz;
+  int i = grid1.cellWeight(xi, wx);
+  int j = grid2.cellWeight(yi, wy);
+  int k = grid3.cellWeight(zi, wz);
   
-  u1 = *ARRAYPTR3D(pF, i, j, k);
-  u2 = *ARRAYPTR3D(pF, i+1, j, k);
-  u3 = *ARRAYPTR3D(pF, i, j+1, k);
-  u4 = *ARRAYPTR3D(pF, i+1, j+1, k);
-  u5 = *ARRAYPTR3D(pF, i, j, k+1);
-  u6 = *ARRAYPTR3D(pF, i+1, j, k+1);
-  u7 = *ARRAYPTR3D(pF, i, j+1, k+1);
-  u8 = *ARRAYPTR3D(pF, i+1, j+1, k+1);
-
-  w1 = u2 + (u2-u1)/(x2-x1)*(a-x2);
-  w2 = u4 + (u4-u3)/(x2-x1)*(a-x2);
-  w3 = w2 + (w2-w1)/(y2-y1)*(b-y2);
-  w4 = u5 + (u6-u5)/(x2-x1)*(a-x1);
-  w5 = u7 + (u8-u7)/(x2-x1)*(a-x1);
-  w6 = w4 + (w5-w4)/(y2-y1)*(b-y1);
-  w7 = w3 + (w6-w3)/(z2-z1)*(c-z1);
-  u = w7;
-
-  return u;
+  double u1 = *ARRAYPTR3D(pF, i, j, k);
+  double u2 = *ARRAYPTR3D(pF, i+1, j, k);
+  double u3 = *ARRAYPTR3D(pF, i, j+1, k);
+  double u4 = *ARRAYPTR3D(pF, i+1, j+1, k);
+  double u5 = *ARRAYPTR3D(pF, i, j, k+1);
+  double u6 = *ARRAYPTR3D(pF, i+1, j, k+1);
+  double u7 = *ARRAYPTR3D(pF, i, j+1, k+1);
+  double u8 = *ARRAYPTR3D(pF, i+1, j+1, k+1);
+
+  // along x, then y, then z
+  double w1 = u1 + wx * (u2 - u1);
+  double w2 = u3 + wx * (u4 - u3);
+  double w3 = w1 + wy * (w2 - w1);
+  double w4 = u5 + wx * (u6 - u5);
+  double w5 = u7 + wx * (u8 - u7);
+  double w6 = w4 + wy * (w5 - w4);
+  return w3 + wz * (w6 - w3);
+}
+// pGrid1-3 are 1d arrays with the grid coords.  each lookup is a bisection; inner loops should build Grid1Ds once
+ double interp3d_grid(PyArrayObject const *pGrid1, PyArrayObject const *pGrid2, PyArrayObject const *pGrid3, PyArrayObject const *pF,
+    double xi, double yi, double zi) {
+  return interp3d_grid(ArrayGrid(pGrid1), ArrayGrid(pGrid2), ArrayGrid(pGrid3), pF, xi, yi, zi);
 }
 double interp3d_grid_wrap(DoublePyArray const &grid1, DoublePyArray const &grid2, DoublePyArray const &grid3, 
     DoublePyArray const &F, double xi, double yi, double zi) {
@@ -360,6 +1114,149 @@ double interp3d_grid_wrap(DoublePyArray const &grid1, DoublePyArray const &grid2
   return interp3d_grid(pGrid1, pGrid2, pGrid3, pF, xi, yi, zi);
 }
 
+// multilinear interpolation on an N-dimensional tensor grid.  the values are kept in a contiguous row-major buffer,
+// and the offsets of the 2^N corners of a cell are precomputed from the strides.  each grid can be uniform or not (see Grid1D).
+// points outside the grid are forced to the boundary.  for N <= 3 this gives the same result as interp1d/2d/3d_grid
+template <int N>
+class InterpND {
+public:
+  static const int N_CORNERS = 1 << N;
+  Grid1D m_Grids[N];
+  size_t m_Strides[N];					// in doubles
+  size_t m_CornerOffsets[N_CORNERS];	// corner k has bit (N-1-d) set if it's on the upper side of dimension d
+  DoubleVector m_Vals;
+  
+  InterpND() {}
+  // grids are the N grids, vals holds prod(grid sizes) values in C order (e.g. a numpy array of shape (n1, ..., nN))
+  InterpND(DoublePyArrayVector const &grids, DoublePyArray const &vals) {
+    if (grids.size() != N) throw std::logic_error("InterpND: wrong number of grids");
+	for (int d=0; d<N; d++) {
+	  m_Grids[d] = Grid1D(grids[d]);
+	}
+	m_Vals.resize(vals.size());
+	std::copy(vals.begin(), vals.end(), m_Vals.begin());
+	init();
+  }
+  InterpND(std::vector<DoubleVector> const &grids, DoubleVector const &vals) : m_Vals(vals) {
+    if (grids.size() != N) throw std::logic_error("InterpND: wrong number of grids");
+	for (int d=0; d<N; d++) {
+	  m_Grids[d] = Grid1D(grids[d]);
+	}
+	init();
+  }
+  
+  void init() {
+    size_t stride = 1;
+	for (int d=N-1; d>=0; d--) {
+	  m_Strides[d] = stride;
+	  stride *= m_Grids[d].size();
+	}
+	if (stride != m_Vals.size()) throw std::logic_error("grid does not match array size");
+	for (int k=0; k<N_CORNERS; k++) {
+	  m_CornerOffsets[k] = 0;
+	  for (int d=0; d<N; d++) {
+	    if (k & (1 << (N-1-d))) {
+		  m_CornerOffsets[k] += m_Strides[d];
+		}
+	  }
+	}
+  }
+  
+  // x is an array of N coordinates
+  double interp(double const *x) const {
+    double w[N];
+	double v[N_CORNERS];
+	size_t base = 0;
+	for (int d=0; d<N; d++) {
+	  base += m_Grids[d].cellWeight(x[d], w[d]) * m_Strides[d];
+	}
+	double const *pCell = &m_Vals[0] + base;
+	for (int k=0; k<N_CORNERS; k++) {
+	  v[k] = pCell[m_CornerOffsets[k]];
+	}
+	return collapseCorners(v, w);
+  }
+  // the 2^N values that interp(x) is a weighted sum of, as indices into m_Vals, and their weights
+  void cornerWeights(double const *x, size_t offsets[N_CORNERS], double weights[N_CORNERS]) const {
+    double w[N];
+	size_t base = 0;
+	for (int d=0; d<N; d++) {
+	  base += m_Grids[d].cellWeight(x[d], w[d]) * m_Strides[d];
+	}
+	for (int k=0; k<N_CORNERS; k++) {
+	  offsets[k] = base + m_CornerOffsets[k];
+	  weights[k] = 1.0;
+	  for (int d=0; d<N; d++) {
+	    weights[k] *= (k & (1 << (N-1-d))) ? w[d] : 1.0 - w[d];
+	  }
+	}
+  }
+  // v holds the values at the 2^N corners, w the weights.  collapse the first dimension, then the second, and so on, in the
+  // same order as interp2d/3d_grid so the results match to the last bit
+  static double collapseCorners(double *v, double const *w) {
+	for (int d=0; d<N; d++) {
+	  int half = 1 << (N-1-d);
+	  for (int k=0; k<half; k++) {
+	    v[k] = v[k] + w[d] * (v[k+half] - v[k]);
+	  }
+	}
+	return v[0];
+  }
+  double operator() (double const *x) const {
+    return interp(x);
+  }
+  double operator() (double x1) const {
+    static_assert(N == 1, "wrong number of coordinates");
+    return interp(&x1);
+  }
+  double operator() (double x1, double x2) const {
+    static_assert(N == 2, "wrong number of coordinates");
+    double x[2] = {x1, x2};
+	return interp(x);
+  }
+  double operator() (double x1, double x2, double x3) const {
+    static_assert(N == 3, "wrong number of coordinates");
+    double x[3] = {x1, x2, x3};
+	return interp(x);
+  }
+  double operator() (double x1, double x2, double x3, double x4) const {
+    static_assert(N == 4, "wrong number of coordinates");
+    double x[4] = {x1, x2, x3, x4};
+	return interp(x);
+  }
+  // interpolate at n points.  points holds them one after another, N coordinates each.
+  // the cells are looked up a block at a time, one dimension at a time
+  void interp_batch(double const *points, size_t n, double *out) const {
+    double x[INTERP_BATCH_POINTS];
+	int cells[N][INTERP_BATCH_POINTS];
+	double weights[N][INTERP_BATCH_POINTS];
+	for (size_t i0=0; i0<n; i0+=INTERP_BATCH_POINTS) {
+	  size_t m = std::min(INTERP_BATCH_POINTS, n - i0);
+	  double const *pPoints = points + i0*N;
+	  for (int d=0; d<N; d++) {
+	    for (size_t i=0; i<m; i++) {
+		  x[i] = pPoints[i*N + d];
+		}
+		m_Grids[d].cellWeight_batch(x, m, cells[d], weights[d]);
+	  }
+	  for (size_t i=0; i<m; i++) {
+	    double w[N];
+		double v[N_CORNERS];
+		size_t base = 0;
+		for (int d=0; d<N; d++) {
+		  base += cells[d][i] * m_Strides[d];
+		  w[d] = weights[d][i];
+		}
+		double const *pCell = &m_Vals[0] + base;
+		for (int k=0; k<N_CORNERS; k++) {
+		  v[k] = pCell[m_CornerOffsets[k]];
+		}
+		out[i0 + i] = collapseCorners(v, w);
+	  }
+	}
+  }
+};
+
 // integrate a given array of f(x) on a grid of x using the trapezoidal rule
 template <class ContainerA, class ContainerB>
 double trapezoid_integrate2(const ContainerA &y,  const ContainerB &x) {
@@ -21,6 +21,14 @@
 #include <float.h>
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <new>
+#include <stdlib.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <pyublas/numpy.hpp>
@@ -37,6 +45,98 @@ typedef std::vector<double> DoubleVector;
 typedef pyublas::numpy_vector<double> DoublePyArray;
 typedef pyublas::numpy_matrix<double> DoublePyMatrix;
 typedef std::vector<DoublePyArray> DoublePyArrayVector;
+
+// maximum number of control variables
+const unsigned int MAX_CONTROLS = 8;
+
+// fixed-capacity vector of control variables, the argument type of the objective function.
+// it reads like a DoubleVector, but lives on the stack, so the search loops don't allocate
+class ControlVector {
+public:
+  typedef double* iterator;
+  typedef double const* const_iterator;
+  typedef double value_type;
+  
+  ControlVector() : m_Size(0) {}
+  explicit ControlVector(size_t n, double value=0.0) : m_Size(0) {
+    resize(n, value);
+  }
+  template <class Iter> ControlVector(Iter first, Iter last) : m_Size(0) {
+    resize(std::distance(first, last));
+	std::copy(first, last, m_Data);
+  }
+  void resize(size_t n, double value=0.0) {
+    if (n > MAX_CONTROLS) {
+	  throw std::length_error("ControlVector: too many control variables");
+	}
+	for (size_t i=m_Size; i<n; i++) {
+	  m_Data[i] = value;
+	}
+	m_Size = n;
+  }
+  size_t size() const { return m_Size; }
+  double& operator[](size_t i) { assert(i < m_Size); return m_Data[i]; }
+  double const& operator[](size_t i) const { assert(i < m_Size); return m_Data[i]; }
+  iterator begin() { return m_Data; }
+  iterator end() { return m_Data + m_Size; }
+  const_iterator begin() const { return m_Data; }
+  const_iterator end() const { return m_Data + m_Size; }
+  
+private:
+  double m_Data[MAX_CONTROLS];
+  size_t m_Size;
+};
+// std allocator whose blocks start on an Align-byte boundary, e.g. a cache line
+template <class T, size_t Align>
+class AlignedAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef T const* const_pointer;
+  typedef T& reference;
+  typedef T const& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template <class U> struct rebind {
+    typedef AlignedAllocator<U, Align> other;
+  };
+  
+  AlignedAllocator() {}
+  template <class U> AlignedAllocator(AlignedAllocator<U, Align> const &) {}
+  
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+  size_type max_size() const { return size_t(-1) / sizeof(T); }
+  void construct(pointer p, T const &val) { new ((void*) p) T(val); }
+  void destroy(pointer p) { p->~T(); }
+  
+  pointer allocate(size_type n, void const * = 0) {
+    if (n == 0) {
+	  return 0;
+	}
+	if (n > max_size()) throw std::bad_alloc();
+#ifdef _MSC_VER
+	void *p = _aligned_malloc(n * sizeof(T), Align);
+	if (p == 0) throw std::bad_alloc();
+#else
+	void *p = 0;
+	if (posix_memalign(&p, Align, n * sizeof(T)) != 0) throw std::bad_alloc();
+#endif
+	return (pointer) p;
+  }
+  void deallocate(pointer p, size_type) {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+	free(p);
+#endif
+  }
+  template <class U> bool operator==(AlignedAllocator<U, Align> const &) const { return true; }
+  template <class U> bool operator!=(AlignedAllocator<U, Align> const &) const { return false; }
+};
+const size_t CACHE_LINE_BYTES = 64;
+typedef std::vector<double, AlignedAllocator<double, CACHE_LINE_BYTES> > AlignedDoubleVector;
+
 // a function that takes a double, returns a double
 typedef double (ddFn) (double arg);
 // takes 2 doubles, returns double
@@ -132,38 +232,34 @@ PyArrayIterator PyArray_end(PyArrayObject const *pArrayObj) {
 }
 
 // an iterator that will iterate through all combinations of elements in N PyArrays.
-// used for evaluating a function at every grid point, given N grids.
+// used for evaluating a function at every grid point, given N grids.  N can be at most MAX_CONTROLS
 class CartesianProductIterator
   : public boost::iterator_facade<
         CartesianProductIterator
-      , DoubleVector const
+      , ControlVector const
       , boost::forward_traversal_tag
     >
 {
  public:
-    explicit CartesianProductIterator(DoublePyArrayVector const &grids, int offset=0, bool bEnd=false)
-	: m_Grids(grids), m_CurrentValue(grids.size()), m_BeginIters(grids.size()), m_EndIters(grids.size()), m_CurrentIters(grids.size()), m_bReachedEnd(bEnd)
+    typedef DoublePyArray::const_iterator GridIter;
+    explicit CartesianProductIterator(DoublePyArrayVector const &grids, size_t offset=0, bool bEnd=false)
+	: m_Grids(grids), m_nGrids(grids.size()), m_CurrentValue(grids.size()), m_bReachedEnd(bEnd)
 	{
 	  // m_BeginIters will contain each grid's begin iter, same for m_EndIters
-	  DoublePyArrayVector::const_iterator gridIter;
-	  std::vector<DoublePyArray::const_iterator>::iterator itersIter;
-	  for (gridIter=grids.begin(), itersIter=m_BeginIters.begin(); gridIter != grids.end(); gridIter++, itersIter++) {
-		   (*itersIter) = (*gridIter).begin();
-	  }
-	  for (gridIter=grids.begin(), itersIter=m_EndIters.begin(); gridIter != grids.end(); gridIter++, itersIter++) {
-		(*itersIter) = (*gridIter).end();
+	  for (int i=0; i<m_nGrids; i++) {
+	    m_BeginIters[i] = grids[i].begin();
+		m_EndIters[i] = grids[i].end();
+		m_CurrentIters[i] = m_BeginIters[i];
 	  }
-	  m_CurrentIters = m_BeginIters;
 	  // jump to offset
-	  int index = offset;		
-	  for (int i=grids.size()-1; i>=0; i--) {
+	  size_t index = offset;		
+	  for (int i=m_nGrids-1; i>=0; i--) {
 		m_CurrentIters[i] += index % grids[i].size();
 		index /= grids[i].size();
 	  }
 	  // m_CurrentValues will store the values pointed to by m_CurrentIters
-	  DoubleVector::iterator valsIter;
-	  for (valsIter=m_CurrentValue.begin(), itersIter=m_CurrentIters.begin(); valsIter != m_CurrentValue.end(); valsIter++, itersIter++) {
-		(*valsIter) = *(*itersIter);
+	  for (int i=0; i<m_nGrids; i++) {
+		m_CurrentValue[i] = *(m_CurrentIters[i]);
 	  }
 	}
 	
@@ -172,19 +268,15 @@ class CartesianProductIterator
 
     void increment() {
 	  assert(m_bReachedEnd == false);
-	  std::vector<DoublePyArray::const_iterator>::reverse_iterator iter_current, iter_begin, iter_end;
-	  DoubleVector::reverse_iterator iter_val;
 	  // go from right to left
-	  for (iter_current=m_CurrentIters.rbegin(), iter_begin = m_BeginIters.rbegin(), iter_end = m_EndIters.rbegin(), iter_val = m_CurrentValue.rbegin(); 
-	       iter_current!=m_CurrentIters.rend(); 
-		   iter_current++, iter_begin++, iter_end++, iter_val++) {
-	    (*iter_current)++;						// increment the currently rightmost iterator
-		if ((*iter_current) != (*iter_end)) {	// if it hasn't reached the end,
-		  (*iter_val) = *(*iter_current);  // update the current value
+	  for (int i=m_nGrids-1; i>=0; i--) {
+	    m_CurrentIters[i]++;						// increment the currently rightmost iterator
+		if (m_CurrentIters[i] != m_EndIters[i]) {	// if it hasn't reached the end,
+		  m_CurrentValue[i] = *(m_CurrentIters[i]);  // update the current value
 		  return;                          // exit loop
 		} else {                           // otherwise, we need to cycle this position back to the beginning, and move left
-		  (*iter_current) = (*iter_begin);
-		  (*iter_val) = *(*iter_current);
+		  m_CurrentIters[i] = m_BeginIters[i];
+		  m_CurrentValue[i] = *(m_CurrentIters[i]);
 		}
 	  }
 	  m_bReachedEnd = true;					// if we've reached here, we've gone all the way around
@@ -192,17 +284,21 @@ class CartesianProductIterator
 	
     bool equal(CartesianProductIterator const& other) const
     {      
-	  assert(m_BeginIters == other.m_BeginIters);
-	  return (m_CurrentIters == other.m_CurrentIters && m_bReachedEnd == other.m_bReachedEnd);
+	  assert(&m_Grids == &other.m_Grids);
+	  if (m_bReachedEnd != other.m_bReachedEnd) {
+	    return false;
+	  }
+	  return std::equal(m_CurrentIters, m_CurrentIters + m_nGrids, other.m_CurrentIters);
     }
 
-    DoubleVector const& dereference() const { 
+    ControlVector const& dereference() const { 
 	  return m_CurrentValue;
 	}
 
 	DoublePyArrayVector const &m_Grids;
-	DoubleVector m_CurrentValue;
-	std::vector<DoublePyArray::const_iterator> m_BeginIters, m_EndIters, m_CurrentIters;
+	int m_nGrids;
+	ControlVector m_CurrentValue;
+	GridIter m_BeginIters[MAX_CONTROLS], m_EndIters[MAX_CONTROLS], m_CurrentIters[MAX_CONTROLS];
 	bool m_bReachedEnd;
 };
 
@@ -17,6 +17,7 @@
 #include <stdarg.h>
 #include <float.h>
 #include <iostream>
+#include <numeric>
 #include <boost/python.hpp>
 #include <boost/python/dict.hpp>
 #include <boost/bind.hpp>
@@ -42,16 +43,26 @@ OptDividendsParams::OptDividendsParams(double beta, DoublePyArray const &randomD
   std::copy(randomDrawsSorted.begin(), randomDrawsSorted.end(), m_RandomDrawsSorted.begin());
 }
 	
-double OptDividendsParams::objectiveFunction(DoubleVector const &controlVars) const {
+double OptDividendsParams::objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const {
   double d = controlVars[0];
-  double M = m_M;
+  double M = state.m_StateVars[0];
   // pre-apply Z_to_nextM to random draws.  must be monotonic
   DoubleVector draws2(m_RandomDrawsSorted.size());
   std::transform(m_RandomDrawsSorted.begin(), m_RandomDrawsSorted.end(), draws2.begin(), [=] (double Z) -> double 
 		  { return M - d + Z; });
   // find the first nextM that is >= 0
   auto firstNonNeg = std::find_if(draws2.begin(), draws2.end(), [] (double x) {return (x>=0.0);} );
-  double sum = m_pPrevIterationInterp->apply_sum_sorted(firstNonNeg, draws2.end());
+  double sum = 0.0;
+  if (m_pPrevIterationSpline) {
+    size_t nNonNeg = draws2.end() - firstNonNeg;
+	DoubleVector nextV(nNonNeg);
+	if (nNonNeg > 0) {
+	  m_pPrevIterationSpline->interp_batch(&*firstNonNeg, nNonNeg, &nextV[0]);
+	}
+	sum = std::accumulate(nextV.begin(), nextV.end(), 0.0);
+  } else {
+    sum = m_pPrevIterationInterp->apply_sum_sorted(firstNonNeg, draws2.end());
+  }
   double EV = sum / draws2.size();
   return d + m_beta * EV;
 }
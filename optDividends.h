@@ -26,31 +26,41 @@ namespace bpl = boost::python;
 // optimal dividends problem
 class OptDividendsParams: public BellmanParams {
   public:
-    double objectiveFunction(DoubleVector const &args) const;
+    double objectiveFunction(BellmanStateContext const &state, ControlVector const &controlVars) const;
 	
     OptDividendsParams(double beta, DoublePyArray const &randomDrawsSorted);
 	
 	// methods inherited from BellmanParams
-	void setStateVars(bpl::list const &stateVars) {
-	  m_M = bpl::extract<double>(stateVars[0]);
-	}
+	// state var: cash reserve M
+	bool hasStateObjectiveFunction() const { return true; }
 	int getNControls() const {
 	  return 1;
 	}
 	void setPrevIteration(bpl::list const &stateGridList, DoublePyArray const &WArray) {
-	  m_StateGrid = bpl::extract<DoublePyArray>(stateGridList[0]);
+	  DoublePyArray stateGrid = bpl::extract<DoublePyArray>(stateGridList[0]);
+	  // the grid is passed in every iteration, but it rarely changes; only rebuild the lookup if it did
+	  if (!m_pStateGridLookup || stateGrid.size() != m_StateGrid.size() ||
+	      !std::equal(stateGrid.begin(), stateGrid.end(), m_StateGrid.begin())) {
+	    m_pStateGridLookup.reset(new Grid1D(stateGrid));
+	  }
+	  m_StateGrid = stateGrid;
 	  m_pStateGrid = (PyArrayObject const*) m_StateGrid.data().handle().get();
       m_PrevIteration = WArray;	
       m_pPrevIterationArray = (PyArrayObject const*) m_PrevIteration.data().handle().get();
-      m_pPrevIterationInterp.reset(new PyInterp1D(m_StateGrid, m_PrevIteration));
+      m_pPrevIterationInterp.reset(new InterpView(m_pStateGridLookup, m_StateGrid, m_PrevIteration));
+	  m_pPrevIterationSpline.reset();
+	  if (m_InterpKind != INTERP_LINEAR) {
+	    m_pPrevIterationSpline.reset(new Spline1D(m_StateGrid, m_PrevIteration, m_InterpKind));
+	  }
 	}
 		
     DoublePyArray m_StateGrid;				// grid over wealth
 	PyArrayObject const *m_pStateGrid;	
-	double m_M;						// state variable: cash reserve
+	std::shared_ptr<Grid1D const> m_pStateGridLookup;
     DoublePyArray m_PrevIteration;			// store the previous iteration of the value function
 	PyArrayObject const *m_pPrevIterationArray;	
-	std::shared_ptr<PyInterp1D> m_pPrevIterationInterp;
+	std::shared_ptr<InterpView> m_pPrevIterationInterp;	// borrows m_StateGrid and m_PrevIteration
+	std::shared_ptr<Spline1D> m_pPrevIterationSpline;	// used instead with m_InterpKind != INTERP_LINEAR
 	
 	double m_beta;				// discrete discount factor
 	std::vector<double> m_RandomDrawsSorted;		// draws for monte carlo
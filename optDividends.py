@@ -131,7 +131,7 @@ class OptDivParams2(mx.TestParamsFn):
 # pass in an array of monte carlo values for Z
 class OptDivParams3(_optDividends.OptDividendsParams):
 	def __init__(self, stateGrid, beta, randomDraws):
-		super(OptDivParams3,self).__init__(stateGrid, beta, randomDraws)
+		super(OptDivParams3,self).__init__(beta, randomDraws)
 		self.stateGrid = stateGrid
 		self.beta = beta
 	def getControlGridList(self, stateVarList):
@@ -139,6 +139,21 @@ class OptDivParams3(_optDividends.OptDividendsParams):
 		M = stateVarList[0]		
 		return [self.stateGrid[self.stateGrid <= M]]
 		
+# grid_bellman with native=True (the state loop in C++, mx.bellmanSweep) should give the same V and policy as the python loop
+def test_nativeBellman(beta=0.9, nDraws=100):
+	grid = scipy.linspace(0.0, 10.0, 21)
+	randomDraws = scipy.sort(scipy.random.uniform(-1.0, 2.0, nDraws))
+	params = OptDivParams3(grid, beta, randomDraws)
+	wArray = scipy.sqrt(grid)
+	(vPython, policyPython) = bellman.grid_bellman([grid], wArray, params, parallel=True, native=False)
+	(vNative, policyNative) = bellman.grid_bellman([grid], wArray, params, parallel=True, native=True)
+	vDiff = scipy.amax(abs(vNative - vPython))
+	policyDiff = scipy.amax(abs(policyNative[0] - policyPython[0]))
+	print("native vs python: max V diff %g, max policy diff %g" % (vDiff, policyDiff))
+	assert(vDiff < 1e-12)
+	assert(policyDiff == 0.0)
+	return (vDiff, policyDiff)
+
 # for solution, see Schmidli, chapter 1	
 # x_0 := sup{x : u(x) = 0}, i.e. the largest starting cash value such that the optimal payout is 0.
 # if x_0 = 0, then it is never optimal to save anything; u(x) = x
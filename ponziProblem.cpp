@@ -165,7 +165,7 @@ void GlobalParams::initGlobalParams() {
 
 // the function to be maximized.  this will be repeatedly called for each value of the control grid in controlVars.
 // state variables (M, D) will be members of PonziParams object
-double PonziParams::objectiveFunction(DoubleVector const &controlVars) const {
+double PonziParams::objectiveFunction(ControlVector const &controlVars) const {
 //double PonziParams::objectiveFunction2(double d, double r) const {
   double d = controlVars[0];
   double r = controlVars[1];
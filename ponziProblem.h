@@ -54,7 +54,7 @@ static void setGlobalParams(double theta, double beta, double gamma, const char*
 
 class PonziParams: public BellmanParams {
   public:
-	double objectiveFunction(DoubleVector const &args) const;
+	double objectiveFunction(ControlVector const &args) const;
     PonziParams() {
 	  m_bPrint = false;
 	}
@@ -0,0 +1,85 @@
+//
+// Copyright (c) 2011 Ronaldo Carpio
+//
+// Permission to use, copy, modify, distribute and sell this software
+// and its documentation for any purpose is hereby granted without fee,
+// provided that the above copyright notice appear in all copies and
+// that both that copyright notice and this permission notice appear
+// in supporting documentation.  The authors make no representations
+// about the suitability of this software for any purpose.
+// It is provided "as is" without express or implied warranty.
+//
+
+
+// CPU feature checks for the SIMD kernels.  the kernels are compiled for their instruction set regardless of the
+// compiler flags (TARGET_AVX2 etc.), and only called if the CPU has it
+
+#ifndef _simd_h
+#define _simd_h
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+#ifdef SIMD_X86
+#if defined(_MSC_VER)
+// the OS must save the AVX (and AVX-512) registers, as well as the CPU supporting the instructions.
+// xcr0Mask is the set of register states that must be enabled, ebxBit is the feature bit in cpuid leaf 7
+inline bool cpuidLeaf7Supports(int ebxBit, unsigned __int64 xcr0Mask) {
+  int info[4];
+  __cpuid(info, 0);
+  int nIds = info[0];
+  __cpuid(info, 1);
+  bool bOSXSave = (info[2] & (1 << 27)) != 0;
+  bool bAVX = (info[2] & (1 << 28)) != 0;
+  if (nIds < 7 || !bOSXSave || !bAVX) {
+    return false;
+  }
+  unsigned __int64 xcr0 = _xgetbv(0);
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << ebxBit)) && (xcr0 & xcr0Mask) == xcr0Mask;
+}
+#endif
+
+inline bool cpuHasAVX2() {
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+  return cpuidLeaf7Supports(5, 0x6);
+#else
+  return false;
+#endif
+}
+inline bool cpuHasAVX512F() {
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f");
+#elif defined(_MSC_VER)
+  return cpuidLeaf7Supports(16, 0xe6);
+#else
+  return false;
+#endif
+}
+#else
+inline bool cpuHasAVX2() {
+  return false;
+}
+inline bool cpuHasAVX512F() {
+  return false;
+}
+#endif //SIMD_X86
+
+#endif //_simd_h
@@ -0,0 +1,197 @@
+//
+// Copyright (c) 2011 Ronaldo Carpio
+//
+// Permission to use, copy, modify, distribute and sell this software
+// and its documentation for any purpose is hereby granted without fee,
+// provided that the above copyright notice appear in all copies and
+// that both that copyright notice and this permission notice appear
+// in supporting documentation.  The authors make no representations
+// about the suitability of this software for any purpose.
+// It is provided "as is" without express or implied warranty.
+//
+
+
+// sparse (Smolyak) grids, for value functions with too many state variables for a tensor grid
+
+#ifndef _sparseGrid_h
+#define _sparseGrid_h
+
+#include <assert.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "myTypes.h"
+
+// a regular sparse grid of a given level on the box [lo, hi], with the piecewise multilinear hierarchical basis.
+// in 1d, level 0 is the two endpoints with basis functions 1-u and u, and level l >= 1 adds the midpoints (2i+1)/2^l of
+// level l-1, each with a hat function of width 2^-(l-1).  the sparse grid is the union of the tensor products of levels
+// (l_1, ..., l_d) with l_1 + ... + l_d <= level.  a tensor grid with 2^level+1 points per dimension has (2^level+1)^d points,
+// the sparse grid has O(2^level * level^(d-1)), and interpolates smooth functions almost as well.
+// the value function is stored as hierarchical surpluses: the value at each point minus the interpolation of the coarser levels.
+// points are stored block by block, one block per level multi-index, in order of increasing l_1 + ... + l_d;
+// within a block they're in C order, the last dimension fastest
+class SparseGrid {
+public:
+  static const int MAX_DIM = 16;
+
+  SparseGrid() : m_Dim(0), m_Level(0), m_nPoints(0) {}
+  SparseGrid(DoubleVector const &lo, DoubleVector const &hi, int level) : m_Dim(lo.size()), m_Level(level), m_Lo(lo), m_Hi(hi) {
+    if (lo.size() != hi.size()) throw std::invalid_argument("SparseGrid: lo and hi must be the same size");
+	if (m_Dim < 1 || m_Dim > MAX_DIM) throw std::invalid_argument("SparseGrid: bad number of dimensions");
+	if (level < 0 || level > 30) throw std::invalid_argument("SparseGrid: bad level");
+	for (int d=0; d<m_Dim; d++) {
+	  if (!(hi[d] > lo[d])) throw std::invalid_argument("SparseGrid: hi must be greater than lo");
+	}
+	// enumerate the level multi-indices by their sum, so that hierarchize() sees coarse levels first
+	m_nPoints = 0;
+	for (int sum=0; sum<=level; sum++) {
+	  IntVector levels(m_Dim, 0);
+	  addBlocks(levels, 0, sum);
+	}
+	m_Surplus.assign(m_nPoints, 0.0);
+  }
+
+  int dim() const {
+    return m_Dim;
+  }
+  int level() const {
+    return m_Level;
+  }
+  size_t size() const {
+    return m_nPoints;
+  }
+  // coordinates of point k
+  void point(size_t k, double *x) const {
+    size_t b = std::upper_bound(m_BlockOffsets.begin(), m_BlockOffsets.end(), k) - m_BlockOffsets.begin() - 1;
+	int const *levels = &m_BlockLevels[b * m_Dim];
+	size_t rest = k - m_BlockOffsets[b];
+	for (int d=m_Dim-1; d>=0; d--) {
+	  size_t n = levelSize(levels[d]);
+	  size_t pos = rest % n;
+	  rest /= n;
+	  double u = (levels[d] == 0) ? double(pos) : double(2*pos + 1) / double(size_t(1) << levels[d]);
+	  x[d] = m_Lo[d] + u * (m_Hi[d] - m_Lo[d]);
+	}
+  }
+  std::vector<DoubleVector> points() const {
+    std::vector<DoubleVector> result(m_nPoints, DoubleVector(m_Dim));
+	for (size_t k=0; k<m_nPoints; k++) {
+	  point(k, &result[k][0]);
+	}
+	return result;
+  }
+
+  // set the function values at the grid points, in the order of point()
+  void setValues(double const *vals) {
+    double x[MAX_DIM];
+	std::fill(m_Surplus.begin(), m_Surplus.end(), 0.0);
+	// a block's basis functions are 0 at the points of every other block whose level sum is the same or smaller (the block
+	// is finer in some dimension, and a hat function is 0 at the coarser points there).  so when point k is reached, the
+	// blocks that are nonzero there are the coarser ones, whose surpluses are already set, and the ones after it, still 0
+	for (size_t k=0; k<m_nPoints; k++) {
+	  point(k, x);
+	  m_Surplus[k] = vals[k] - interp(x);
+	}
+  }
+
+  // points outside the box are forced to the boundary
+  double interp(double const *x) const {
+    double u[MAX_DIM];
+	for (int d=0; d<m_Dim; d++) {
+	  u[d] = std::min(1.0, std::max(0.0, (x[d] - m_Lo[d]) / (m_Hi[d] - m_Lo[d])));
+	}
+	// each block has at most 2^(number of level 0 dims) basis functions that are nonzero at u
+	size_t pos[MAX_DIM][2];
+	double w[MAX_DIM][2];
+	int nTerms[MAX_DIM];
+	double result = 0.0;
+	size_t nBlocks = m_BlockOffsets.size();
+	for (size_t b=0; b<nBlocks; b++) {
+	  int const *levels = &m_BlockLevels[b * m_Dim];
+	  bool bZero = false;
+	  size_t combos = 1;
+	  for (int d=0; d<m_Dim && !bZero; d++) {
+	    if (levels[d] == 0) {
+		  pos[d][0] = 0;
+		  w[d][0] = 1.0 - u[d];
+		  pos[d][1] = 1;
+		  w[d][1] = u[d];
+		  nTerms[d] = 2;
+		  combos *= 2;
+		} else {
+		  size_t n = levelSize(levels[d]);
+		  double scaled = u[d] * double(size_t(1) << levels[d]);
+		  size_t p = std::min(n - 1, size_t(scaled / 2.0));
+		  double hat = 1.0 - fabs(scaled - double(2*p + 1));
+		  if (hat <= 0.0) {
+		    bZero = true;
+		  }
+		  pos[d][0] = p;
+		  w[d][0] = hat;
+		  nTerms[d] = 1;
+		}
+	  }
+	  if (bZero) {
+	    continue;
+	  }
+	  double const *pSurplus = &m_Surplus[m_BlockOffsets[b]];
+	  for (size_t c=0; c<combos; c++) {
+	    size_t index = 0;
+		double weight = 1.0;
+		size_t bits = c;
+		for (int d=0; d<m_Dim; d++) {
+		  int t = 0;
+		  if (nTerms[d] == 2) {
+		    t = bits & 1;
+			bits >>= 1;
+		  }
+		  index = index * levelSize(levels[d]) + pos[d][t];
+		  weight *= w[d][t];
+		}
+		result += weight * pSurplus[index];
+	  }
+	}
+	return result;
+  }
+  // interpolate at n points.  points holds them one after another, dim() coordinates each
+  void interp_batch(double const *points, size_t n, double *out) const {
+    for (size_t i=0; i<n; i++) {
+	  out[i] = interp(points + i*m_Dim);
+	}
+  }
+
+private:
+  // number of points of 1d level l
+  static size_t levelSize(int l) {
+    return (l == 0) ? 2 : (size_t(1) << (l-1));
+  }
+  // add the blocks whose levels in dimensions d.. sum to remaining
+  void addBlocks(IntVector &levels, int d, int remaining) {
+    if (d == m_Dim - 1) {
+	  levels[d] = remaining;
+	  size_t n = 1;
+	  for (int e=0; e<m_Dim; e++) {
+	    n *= levelSize(levels[e]);
+	  }
+	  m_BlockLevels.insert(m_BlockLevels.end(), levels.begin(), levels.end());
+	  m_BlockOffsets.push_back(m_nPoints);
+	  m_nPoints += n;
+	  return;
+	}
+	for (int l=0; l<=remaining; l++) {
+	  levels[d] = l;
+	  addBlocks(levels, d+1, remaining - l);
+	}
+  }
+
+  int m_Dim, m_Level;
+  DoubleVector m_Lo, m_Hi;
+  IntVector m_BlockLevels;				// m_Dim levels per block
+  std::vector<size_t> m_BlockOffsets;	// index of each block's first point
+  size_t m_nPoints;
+  DoubleVector m_Surplus;
+};
+
+#endif //_sparseGrid_h
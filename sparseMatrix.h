@@ -0,0 +1,201 @@
+//
+// Copyright (c) 2011 Ronaldo Carpio
+//
+// Permission to use, copy, modify, distribute and sell this software
+// and its documentation for any purpose is hereby granted without fee,
+// provided that the above copyright notice appear in all copies and
+// that both that copyright notice and this permission notice appear
+// in supporting documentation.  The authors make no representations
+// about the suitability of this software for any purpose.
+// It is provided "as is" without express or implied warranty.
+//
+
+
+// sparse matrices and an iterative linear solver, for evaluating a fixed policy exactly instead of by fixed-point iteration
+
+#ifndef _sparseMatrix_h
+#define _sparseMatrix_h
+
+#include <assert.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/blocked_range.h"
+
+#include "myTypes.h"
+
+// a square matrix in compressed sparse row format
+class SparseMatrixCSR {
+public:
+  SparseMatrixCSR() {
+    m_RowBegin.push_back(0);
+  }
+  size_t nRows() const {
+    return m_RowBegin.size() - 1;
+  }
+  size_t nEntries() const {
+    return m_Vals.size();
+  }
+  // add the next row.  cols don't have to be sorted
+  template <class ColT>
+  void appendRow(ColT const *cols, double const *vals, size_t n) {
+    m_Cols.insert(m_Cols.end(), cols, cols + n);
+	m_Vals.insert(m_Vals.end(), vals, vals + n);
+	m_RowBegin.push_back(m_Vals.size());
+  }
+  double rowDot(size_t i, double const *x) const {
+    double sum = 0.0;
+	for (size_t k=m_RowBegin[i]; k<m_RowBegin[i+1]; k++) {
+	  sum += m_Vals[k] * x[m_Cols[k]];
+	}
+	return sum;
+  }
+  double diagonal(size_t i) const {
+    double sum = 0.0;
+	for (size_t k=m_RowBegin[i]; k<m_RowBegin[i+1]; k++) {
+	  if (m_Cols[k] == i) {
+	    sum += m_Vals[k];
+	  }
+	}
+	return sum;
+  }
+
+  std::vector<size_t> m_RowBegin;		// first entry of each row, plus one past the end
+  std::vector<size_t> m_Cols;
+  DoubleVector m_Vals;
+};
+
+// solve (I - A) x = b with BiCGSTAB and a Jacobi preconditioner.  x holds the initial guess, and the solution on return.
+// stops when the residual |b - (I - A) x| is less than tol * |b| (2-norms), or after maxIters iterations.
+// on a breakdown (a zero denominator) it restarts from the current x, up to maxRestarts times.
+// returns the number of iterations, and the relative residual in rResidual; the caller should check it against tol.
+// for a value function, A is the discounted transition matrix of a policy, so I - A is diagonally dominant if the
+// discount factor is less than 1.  with bParallel, the matrix-vector products and dot products are done with TBB
+inline int solveIdentityMinus(SparseMatrixCSR const &A, DoubleVector const &b, DoubleVector &x, double tol, int maxIters, double &rResidual,
+  bool bParallel=false, int maxRestarts=10) {
+  size_t n = A.nRows();
+  if (b.size() != n || x.size() != n) throw std::invalid_argument("solveIdentityMinus: sizes don't match");
+  const size_t grainSize = 1024;
+  // y = (I - A) x
+  auto apply = [&](DoubleVector const &v, DoubleVector &y) {
+    auto fn = [&](tbb::blocked_range<size_t> const &r) {
+      for (size_t i=r.begin(); i<r.end(); i++) {
+	    y[i] = v[i] - A.rowDot(i, &v[0]);
+	  }
+	};
+	if (bParallel) {
+	  tbb::parallel_for(tbb::blocked_range<size_t>(0, n, grainSize), fn);
+	} else {
+	  fn(tbb::blocked_range<size_t>(0, n));
+	}
+  };
+  auto dot = [&](DoubleVector const &u, DoubleVector const &v) -> double {
+    auto fn = [&](tbb::blocked_range<size_t> const &r, double sum) -> double {
+      for (size_t i=r.begin(); i<r.end(); i++) {
+	    sum += u[i] * v[i];
+	  }
+	  return sum;
+	};
+	if (bParallel) {
+	  return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, n, grainSize), 0.0, fn, std::plus<double>());
+	}
+	return fn(tbb::blocked_range<size_t>(0, n), 0.0);
+  };
+  DoubleVector invDiag(n);
+  for (size_t i=0; i<n; i++) {
+    double d = 1.0 - A.diagonal(i);
+	invDiag[i] = (d != 0.0) ? 1.0 / d : 1.0;
+  }
+  double bNorm = sqrt(dot(b, b));
+  if (bNorm == 0.0) {
+    bNorm = 1.0;
+  }
+  DoubleVector r(n), rHat(n), p(n, 0.0), v(n, 0.0), s(n), t(n), y(n), z(n);
+  apply(x, r);
+  for (size_t i=0; i<n; i++) {
+    r[i] = b[i] - r[i];
+  }
+  rHat = r;
+  rResidual = sqrt(dot(r, r)) / bNorm;
+  double rho = 1.0, alpha = 1.0, omega = 1.0;
+  int nRestarts = 0;
+  // start over with the current residual as the shadow residual.  returns false if there are no restarts left
+  auto restart = [&]() -> bool {
+    if (nRestarts == maxRestarts) {
+	  return false;
+	}
+	nRestarts++;
+	rHat = r;
+	std::fill(p.begin(), p.end(), 0.0);
+	std::fill(v.begin(), v.end(), 0.0);
+	rho = alpha = omega = 1.0;
+	return true;
+  };
+  int iter;
+  for (iter=0; iter<maxIters && rResidual >= tol; iter++) {
+    double rhoNew = dot(rHat, r);
+	if (rhoNew == 0.0) {
+	  // breakdown.  after a restart, rhoNew = |r|^2, which is only 0 if r is
+	  if (!restart()) {
+	    break;
+	  }
+	  rhoNew = dot(rHat, r);
+	  if (rhoNew == 0.0) {
+	    break;
+	  }
+	}
+	double beta = (rhoNew / rho) * (alpha / omega);
+	for (size_t i=0; i<n; i++) {
+	  p[i] = r[i] + beta * (p[i] - omega * v[i]);
+	  y[i] = invDiag[i] * p[i];
+	}
+	apply(y, v);
+	double rHatV = dot(rHat, v);
+	if (rHatV == 0.0) {
+	  if (!restart()) {
+	    break;
+	  }
+	  continue;
+	}
+	alpha = rhoNew / rHatV;
+	for (size_t i=0; i<n; i++) {
+	  s[i] = r[i] - alpha * v[i];
+	}
+	double sResidual = sqrt(dot(s, s)) / bNorm;
+	if (sResidual < tol) {
+	  for (size_t i=0; i<n; i++) {
+	    x[i] += alpha * y[i];
+	  }
+	  rResidual = sResidual;
+	  iter++;
+	  break;
+	}
+	for (size_t i=0; i<n; i++) {
+	  z[i] = invDiag[i] * s[i];
+	}
+	apply(z, t);
+	double tt = dot(t, t);
+	omega = (tt != 0.0) ? dot(t, s) / tt : 0.0;
+	for (size_t i=0; i<n; i++) {
+	  x[i] += alpha * y[i] + omega * z[i];
+	  r[i] = s[i] - omega * t[i];
+	}
+	rResidual = sqrt(dot(r, r)) / bNorm;
+	if (!(rResidual == rResidual)) {
+	  break;			// NaN
+	}
+	rho = rhoNew;
+	// the next beta divides by omega
+	if (omega == 0.0 && rResidual >= tol && !restart()) {
+	  iter++;
+	  break;
+	}
+  }
+  return iter;
+}
+
+#endif //_sparseMatrix_h